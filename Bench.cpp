@@ -0,0 +1,246 @@
+﻿// Times every pass of Fluid::Update on its own and the full step over a sweep
+// of particle counts and scenes, and writes the results as JSON:
+//
+//   FluidBench [--min-particles N] [--max-particles N] [--repeats N]
+//              [--scene name] [--output file.json]
+//
+// Counts go from --min-particles (1K) to --max-particles (4M) in factors of 4,
+// powers of two for the spatial lookup sort: the minimum is rounded up and the
+// maximum down to one. Each pass runs on the state left
+// by a full step, bracketed by glFinish, so the times hold on any backend
+// including software GL. Without --output the JSON goes to stdout and the
+// progress to stderr. Run from the directory with the .comp files.
+#include<iostream>
+#include<glad/glad.h>
+
+#include "Fluid.h"
+#include "ComputeShader.h"
+#include "HeadlessContext.h"
+#include "GpuProfiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Same fluid as Main.cpp, the domain grows with the particle count
+const float PARTICLE_RADIUS = 0.0075f;
+const float MASS = 0.075f;
+const float GRAVITY_ACCELERATION = 1.2f;
+const float COLLISION_DAMPING = 0.6f;
+const float BOUNDARY_X = 1.2f;
+const float BOUNDARY_Y = 0.7f;
+const float BOUNDARY_Z = 0.7f;
+const float SMOOTHING_RADIUS = 0.082f;
+const float PRESSURE_MULTIPLIER = 2.0f;
+const float TARGET_DENSITY = 1000.0f;
+const float VISCOSITY_STRENGTH = 0.2f;
+const float NEAR_DENSITY_MULTIPLIER = 0.2f;
+const float DELTA_TIME = 0.016f;
+const float RESORT_THRESHOLD = 0.2f;
+const bool PACKED_DENSITIES = true;
+const bool HALF_VELOCITIES = true;
+const bool SPECIALIZED_SHADERS = true;
+const char* SHADER_CACHE_DIRECTORY = "shader_cache";
+
+const float INTERACTION_RADIUS = 0.3f;
+const float INTERACTION_STRENGTH = 15.0f;
+
+const unsigned int MIN_PARTICLES = 1024;
+const unsigned int MAX_PARTICLES = 4 * 1024 * 1024;
+const unsigned int DEFAULT_REPEATS = 10;
+const unsigned int WARMUP_STEPS = 3;
+
+struct Scene {
+	const char* name;
+	float spacing;        // of the initial block
+	GridMode gridMode;
+	bool incrementalSort;
+};
+
+const Scene SCENES[] = {
+	{ "block", 0.025f, GRID_HASHED, true },            // the default configuration
+	{ "block-full-sort", 0.025f, GRID_HASHED, false }, // rebuilds the lookup every step
+	{ "dense", 0.018f, GRID_HASHED, false },           // about 2.7x the neighbors
+	{ "sparse-grid", 0.025f, GRID_SPARSE, false },
+};
+
+struct Result {
+	std::string scene;
+	unsigned int particles;
+	std::string stage;
+	unsigned int runs;
+	double msPerRun;
+};
+
+// Wall time of 'runs' calls, the GPU is drained before and after
+template<typename Function>
+static double TimeRuns(unsigned int runs, Function run)
+{
+	glFinish();
+	auto start = std::chrono::steady_clock::now();
+	for (unsigned int i = 0; i < runs; ++i) run();
+	glFinish();
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() / runs;
+}
+
+// Passes of one step in execution order, as named in the frame graph
+static std::vector<std::string> StageNames(Fluid& fluid)
+{
+	GpuProfiler profiler(1);
+	fluid.SetProfiler(&profiler);
+	profiler.beginFrame();
+	fluid.Update(DELTA_TIME);
+	profiler.endFrame();
+	glFinish(); // results that are not back yet would be dropped
+	profiler.beginFrame();
+	profiler.endFrame();
+	fluid.SetProfiler(nullptr);
+
+	std::vector<std::string> names;
+	for (const GpuProfiler::StageStatistics& stage : profiler.statistics()) names.push_back(stage.name);
+	return names;
+}
+
+static void BenchmarkScene(const Scene& scene, unsigned int particleCount, unsigned int repeats, std::vector<Result>& results)
+{
+	// Keep the initial block inside the domain with room to settle
+	float halfBlock = 0.5f * std::ceil(std::cbrt(float(particleCount))) * scene.spacing;
+	float boundaryX = std::max(BOUNDARY_X, 1.5f * halfBlock);
+	float boundaryY = std::max(BOUNDARY_Y, 1.5f * halfBlock);
+	float boundaryZ = std::max(BOUNDARY_Z, 1.5f * halfBlock);
+
+	Fluid fluid(particleCount, PARTICLE_RADIUS, MASS, GRAVITY_ACCELERATION, COLLISION_DAMPING, scene.spacing, PRESSURE_MULTIPLIER, TARGET_DENSITY, SMOOTHING_RADIUS, particleCount * 4, INTERACTION_RADIUS, INTERACTION_STRENGTH, VISCOSITY_STRENGTH, NEAR_DENSITY_MULTIPLIER, boundaryX, boundaryY, boundaryZ);
+	fluid.SetIncrementalSort(scene.incrementalSort);
+	fluid.SetResortThreshold(RESORT_THRESHOLD);
+	fluid.SetGridMode(scene.gridMode);
+	fluid.SetPackedDensities(PACKED_DENSITIES);
+	fluid.SetHalfVelocities(HALF_VELOCITIES);
+	fluid.SetSpecializedShaders(SPECIALIZED_SHADERS);
+
+	for (unsigned int i = 0; i < WARMUP_STEPS; ++i) fluid.Update(DELTA_TIME);
+
+	// Every pass starts from the state of a full step, so passes that write
+	// their own inputs do not skew the ones timed after them
+	for (const std::string& stage : StageNames(fluid)) {
+		fluid.Update(DELTA_TIME);
+		fluid.UpdatePass(stage.c_str(), DELTA_TIME);
+		double ms = TimeRuns(repeats, [&]() { fluid.UpdatePass(stage.c_str(), DELTA_TIME); });
+		results.push_back(Result{ scene.name, particleCount, stage, repeats, ms });
+		std::cerr << scene.name << ", " << particleCount << ", " << stage << ": " << ms << " ms\n";
+	}
+
+	double ms = TimeRuns(repeats, [&]() { fluid.Update(DELTA_TIME); });
+	results.push_back(Result{ scene.name, particleCount, "step", repeats, ms });
+	std::cerr << scene.name << ", " << particleCount << ", step: " << ms << " ms\n";
+}
+
+static std::string JsonString(const std::string& text)
+{
+	std::string result = "\"";
+	for (char c : text) {
+		if (c == '"' || c == '\\') result += '\\';
+		result += c;
+	}
+	return result + "\"";
+}
+
+static void WriteJson(std::ostream& out, const std::vector<Result>& results, unsigned int repeats)
+{
+	out << "{\n";
+	out << "  \"renderer\": " << JsonString(reinterpret_cast<const char*>(glGetString(GL_RENDERER))) << ",\n";
+	out << "  \"vendor\": " << JsonString(reinterpret_cast<const char*>(glGetString(GL_VENDOR))) << ",\n";
+	out << "  \"version\": " << JsonString(reinterpret_cast<const char*>(glGetString(GL_VERSION))) << ",\n";
+	out << "  \"repeats\": " << repeats << ",\n";
+	out << "  \"results\": [";
+	for (size_t i = 0; i < results.size(); ++i) {
+		const Result& result = results[i];
+		double seconds = result.msPerRun * 1e-3;
+		out << (i ? ",\n" : "\n")
+			<< "    {\"scene\": " << JsonString(result.scene)
+			<< ", \"particles\": " << result.particles
+			<< ", \"stage\": " << JsonString(result.stage)
+			<< ", \"runs\": " << result.runs
+			<< ", \"ms\": " << result.msPerRun
+			<< ", \"runs_per_second\": " << (seconds > 0.0 ? 1.0 / seconds : 0.0)
+			<< ", \"particles_per_second\": " << (seconds > 0.0 ? result.particles / seconds : 0.0)
+			<< ", \"ns_per_particle\": " << seconds * 1e9 / result.particles << "}";
+	}
+	out << "\n  ]\n}\n";
+}
+
+int main(int argc, char** argv) {
+	unsigned int minParticles = MIN_PARTICLES;
+	unsigned int maxParticles = MAX_PARTICLES;
+	unsigned int repeats = DEFAULT_REPEATS;
+	std::string sceneName;
+	std::string outputFile;
+
+	for (int i = 1; i < argc; ++i) {
+		std::string option = argv[i];
+		if (i + 1 >= argc) {
+			std::cerr << "Missing value for " << option << "\n";
+			return -1;
+		}
+		std::string value = argv[++i];
+		if (option == "--min-particles") minParticles = static_cast<unsigned int>(std::strtoul(value.c_str(), nullptr, 10));
+		else if (option == "--max-particles") maxParticles = static_cast<unsigned int>(std::strtoul(value.c_str(), nullptr, 10));
+		else if (option == "--repeats") repeats = std::max(1u, static_cast<unsigned int>(std::strtoul(value.c_str(), nullptr, 10)));
+		else if (option == "--scene") sceneName = value;
+		else if (option == "--output") outputFile = value;
+		else {
+			std::cerr << "Unknown option " << option << "\n";
+			return -1;
+		}
+	}
+
+	// The spatial lookup sort takes a power of two particles
+	unsigned int sortableMin = Fluid::SortableParticleCount(minParticles);
+	unsigned int sortableMax = Fluid::SortableParticleCount(maxParticles);
+	if (sortableMax != maxParticles) sortableMax = (sortableMax == 0) ? MAX_INT / 2 + 1 : sortableMax / 2;
+	if (minParticles == 0 || sortableMin == 0 || maxParticles == 0 || sortableMin > sortableMax) {
+		std::cerr << "No power of two particle count between " << minParticles << " and " << maxParticles << "\n";
+		return -1;
+	}
+	if (sortableMin != minParticles || sortableMax != maxParticles) {
+		std::cerr << "Sweeping " << sortableMin << " to " << sortableMax << " particles, powers of two\n";
+		minParticles = sortableMin;
+		maxParticles = sortableMax;
+	}
+
+	HeadlessContext context;
+	if (!context.loadGL()) {
+		std::cerr << "Failed to initialize GLAD\n";
+		return -1;
+	}
+	ComputeShader::setBinaryCacheDirectory(SHADER_CACHE_DIRECTORY);
+	ComputeShader::enableParallelCompile((GLADloadproc)HeadlessContext::getProcAddress);
+
+	std::vector<Result> results;
+	for (const Scene& scene : SCENES) {
+		if (!sceneName.empty() && sceneName != scene.name) continue;
+		for (unsigned int count = minParticles; count <= maxParticles; count *= 4) {
+			BenchmarkScene(scene, count, repeats, results);
+			if (count > maxParticles / 4) break; // the next count would pass the maximum or wrap
+		}
+	}
+	if (results.empty()) {
+		std::cerr << "Nothing to run, check --scene\n";
+		return -1;
+	}
+
+	if (outputFile.empty()) {
+		WriteJson(std::cout, results, repeats);
+		return 0;
+	}
+	std::ofstream out(outputFile);
+	if (!out.is_open()) {
+		std::cerr << "Could not write " << outputFile << "\n";
+		return -1;
+	}
+	WriteJson(out, results, repeats);
+	return 0;
+}
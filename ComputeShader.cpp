@@ -1,81 +1,377 @@
 #include "ComputeShader.h"
+#include "ProgramBinaryCache.h"
+#include "Trace.h"
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+
+namespace {
+	// GL_KHR_parallel_shader_compile, not part of the glad profile
+	const GLenum COMPLETION_STATUS = 0x91B1;
+	typedef void (APIENTRYP MaxShaderCompilerThreadsProc)(GLuint count);
+	bool s_completionStatus = false;
+
+	// Threads that run link jobs on their own shared contexts, in submission order
+	class CompileWorkers
+	{
+	public:
+		void start(std::vector<CompileContext> contexts)
+		{
+			stop();
+			_stopping = false;
+			for (CompileContext& context : contexts) {
+				_threads.emplace_back([this, context]() {
+					context(true);
+					run();
+					context(false);
+				});
+			}
+		}
+
+		// Finishes the queued jobs first
+		void stop()
+		{
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_stopping = true;
+			}
+			_wake.notify_all();
+			for (std::thread& thread : _threads) thread.join();
+			_threads.clear();
+		}
+
+		bool running() const { return !_threads.empty(); }
+
+		std::shared_future<void> submit(std::function<void()> job)
+		{
+			std::packaged_task<void()> task(std::move(job));
+			std::shared_future<void> done = task.get_future().share();
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_jobs.push_back(std::move(task));
+			}
+			_wake.notify_one();
+			return done;
+		}
+
+	private:
+		std::vector<std::thread> _threads;
+		std::deque<std::packaged_task<void()>> _jobs;
+		std::mutex _mutex;
+		std::condition_variable _wake;
+		bool _stopping = false;
+
+		void run()
+		{
+			for (;;) {
+				std::packaged_task<void()> task;
+				{
+					std::unique_lock<std::mutex> lock(_mutex);
+					_wake.wait(lock, [this]() { return _stopping || !_jobs.empty(); });
+					if (_jobs.empty()) return;
+					task = std::move(_jobs.front());
+					_jobs.pop_front();
+				}
+				task();
+			}
+		}
+	};
+
+	CompileWorkers& Workers()
+	{
+		static CompileWorkers workers;
+		return workers;
+	}
+}
 
 ComputeShader::ComputeShader(const char* computeFile) 
+	: _file(computeFile), _workGroupSize(0)
+{
+	_source = loadShaderSource(computeFile);
+	_id = buildProgram("");
+	_programs[""] = _id;
+}
+
+ComputeShader::~ComputeShader() 
+{
+	for (auto& program : _programs) {
+		finishProgram(program.second);
+		glDeleteProgram(program.second);
+	}
+}
+
+// Issues the compile and link and returns right away, finishProgram checks the
+// result once the program is needed
+unsigned int ComputeShader::buildProgram(const std::string& defines)
+{
+	// Defines go right after the #version line, which has to stay first,
+	// #line keeps error messages pointing at the file's own line numbers
+	std::string code = _source;
+	size_t versionEnd = code.find('\n');
+	if (!defines.empty()) {
+		code.insert(versionEnd == std::string::npos ? code.size() : versionEnd + 1, defines + "#line 2 0\n");
+	}
+
+	GLuint program = glCreateProgram();
+	std::string cachePath = ProgramBinaryCachePath(code);
+	if (!cachePath.empty() && LoadProgramBinary(cachePath, program)) return program;
+
+	if (!s_completionStatus && Workers().running()) {
+		// Program names are shared, the worker links into this one. glFinish
+		// makes the result visible here once the future is ready.
+		PendingLink& pending = _pending[program];
+		pending.shader = 0;
+		pending.worker = Workers().submit([this, program, code, cachePath]() {
+			endLink(program, beginLink(program, code, cachePath), cachePath);
+			glFinish();
+		});
+		return program;
+	}
+
+	_pending[program] = PendingLink{ beginLink(program, code, cachePath), cachePath, {} };
+	return program;
+}
+
+unsigned int ComputeShader::beginLink(unsigned int program, const std::string& code, const std::string& cachePath) const
 {
-	std::string code = loadShaderSource(computeFile);
 	const char* src = code.c_str();
 
 	GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
 	glShaderSource(shader, 1, &src, nullptr);
 	glCompileShader(shader);
-	checkCompileErrors(shader, "COMPUTE", computeFile);
 
-	_id = glCreateProgram();
-	glAttachShader(_id, shader);
-	glLinkProgram(_id);
-	checkCompileErrors(_id, "PROGRAM", computeFile);
+	glAttachShader(program, shader);
+	if (!cachePath.empty()) glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glLinkProgram(program);
+	return shader;
+}
 
+// The status queries wait for the driver to finish
+void ComputeShader::endLink(unsigned int program, unsigned int shader, const std::string& cachePath) const
+{
+	checkCompileErrors(shader, "COMPUTE", _file.c_str());
+	checkCompileErrors(program, "PROGRAM", _file.c_str());
+	glDetachShader(program, shader);
 	glDeleteShader(shader);
+	if (!cachePath.empty()) SaveProgramBinary(cachePath, program);
 }
 
-ComputeShader::~ComputeShader() 
+void ComputeShader::finishProgram(unsigned int program) const
+{
+	auto pending = _pending.find(program);
+	if (pending == _pending.end()) return;
+
+	if (pending->second.worker.valid()) pending->second.worker.get();
+	else endLink(program, pending->second.shader, pending->second.cachePath);
+	_pending.erase(pending);
+}
+
+bool ComputeShader::isReady() const
+{
+	for (const auto& pending : _pending) {
+		if (pending.second.worker.valid()) {
+			if (pending.second.worker.wait_for(std::chrono::seconds(0)) != std::future_status::ready) return false;
+		}
+		else if (s_completionStatus) {
+			GLint done = GL_FALSE;
+			glGetProgramiv(pending.first, COMPLETION_STATUS, &done);
+			if (!done) return false;
+		}
+		// Without either only the blocking status query could tell
+	}
+	return true;
+}
+
+bool ComputeShader::enableParallelCompile(GLADloadproc load)
+{
+	GLint count = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+	const char* entryPoint = nullptr;
+	for (GLint i = 0; i < count && !entryPoint; ++i) {
+		const char* name = reinterpret_cast<const char*>(glGetStringi(GL_EXTENSIONS, i));
+		if (std::strcmp(name, "GL_KHR_parallel_shader_compile") == 0) entryPoint = "glMaxShaderCompilerThreadsKHR";
+		else if (std::strcmp(name, "GL_ARB_parallel_shader_compile") == 0) entryPoint = "glMaxShaderCompilerThreadsARB";
+	}
+	if (!entryPoint) return false;
+
+	MaxShaderCompilerThreadsProc maxShaderCompilerThreads = reinterpret_cast<MaxShaderCompilerThreadsProc>(load(entryPoint));
+	if (!maxShaderCompilerThreads) return false;
+
+	// Let the driver pick the thread count
+	maxShaderCompilerThreads(0xFFFFFFFFu);
+	s_completionStatus = true;
+	return true;
+}
+
+void ComputeShader::startCompileWorkers(std::vector<CompileContext> contexts)
+{
+	Workers().start(std::move(contexts));
+}
+
+void ComputeShader::stopCompileWorkers()
+{
+	Workers().stop();
+}
+
+void ComputeShader::setBinaryCacheDirectory(const std::string& directory)
+{
+	SetProgramBinaryCacheDirectory(directory);
+}
+
+void ComputeShader::specialize(const ShaderDefines& defines)
+{
+	_specialization = defines;
+	selectProgram();
+}
+
+void ComputeShader::setWorkGroupSize(unsigned int size)
+{
+	_workGroupSize = size;
+	selectProgram();
+}
+
+unsigned int ComputeShader::workGroupSize() const
+{
+	auto known = _workGroupSizes.find(_id);
+	if (known != _workGroupSizes.end()) return known->second;
+
+	finishProgram(_id);
+	GLint size[3] = { 0, 0, 0 };
+	glGetProgramiv(_id, GL_COMPUTE_WORK_GROUP_SIZE, size);
+	// A program that failed to link reports nothing, dispatch one invocation per group
+	unsigned int sizeX = size[0] > 0 ? unsigned(size[0]) : 1u;
+	_workGroupSizes[_id] = sizeX;
+	return sizeX;
+}
+
+// Programs are keyed by their full define block, the workgroup size first
+void ComputeShader::selectProgram()
 {
-	glDeleteProgram(_id);
+	std::string block;
+	if (_workGroupSize) block += "#define LOCAL_SIZE " + std::to_string(_workGroupSize) + "\n";
+	for (const auto& define : _specialization) {
+		block += "#define " + define.first + " " + define.second + "\n";
+	}
+	if (block == _defines) return;
+
+	auto cached = _programs.find(block);
+	if (cached == _programs.end()) {
+		cached = _programs.emplace(block, buildProgram(block)).first;
+	}
+	_id = cached->second;
+	_defines = block;
 }
 
 void ComputeShader::use() const 
 {
+	finishProgram(_id);
 	glUseProgram(_id);
 }
 
 void ComputeShader::dispatch(unsigned int groupsX, unsigned int groupsY, unsigned int groupsZ) const 
 {
+	TRACE_ZONE(_file.c_str());
 	glDispatchCompute(groupsX, groupsY, groupsZ);
 }
 
+void ComputeShader::dispatchFor(unsigned int invocations) const
+{
+	const unsigned int size = workGroupSize();
+	dispatch((invocations + size - 1) / size);
+}
+
+void ComputeShader::dispatchIndirect(unsigned int buffer, GLintptr offset) const
+{
+	TRACE_ZONE(_file.c_str());
+	glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, buffer);
+	glDispatchComputeIndirect(offset);
+	glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, 0);
+}
+
 void ComputeShader::setInt(const char* name, int value) const 
 {
+	finishProgram(_id);
 	glUniform1i(glGetUniformLocation(_id, name), value);
 }
 
 void ComputeShader::setFloat(const char* name, float value) const
 {
+	finishProgram(_id);
 	glUniform1f(glGetUniformLocation(_id, name), value);
 }
 
 void ComputeShader::setUint(const char* name, const unsigned int value) const 
 {
+	finishProgram(_id);
 	glUniform1ui(glGetUniformLocation(_id, name), value);
 }
 
-unsigned int ComputeShader::getID() { return _id; }
+unsigned int ComputeShader::getID()
+{
+	finishProgram(_id);
+	return _id;
+}
 
 void ComputeShader::wait() const 
 {
 	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
 }
 
-std::string ComputeShader::loadShaderSource(const char* filePath) const {
+std::string ComputeShader::loadShaderSource(const char* filePath) {
+	_sourceFiles.clear();
+	return expandIncludes(filePath, 0);
+}
+
+std::string ComputeShader::expandIncludes(const std::string& filePath, int depth) {
 	std::ifstream in(filePath);
 	if (!in.is_open()) {
 		std::cerr << "ERROR: Could not open compute shader file: "
 			<< filePath << "\n";
 		return "";
 	}
-	std::stringstream ss;
-	ss << in.rdbuf();
-	return ss.str();
+	if (depth > 16) {
+		std::cerr << "ERROR: #include nested too deeply in " << filePath << "\n";
+		return "";
+	}
+
+	const size_t sourceIndex = _sourceFiles.size();
+	_sourceFiles.push_back(filePath);
+	const size_t slash = filePath.find_last_of("/\\");
+	const std::string directory = (slash == std::string::npos) ? "" : filePath.substr(0, slash + 1);
+
+	std::stringstream out;
+	std::string line;
+	int lineNumber = 0;
+	while (std::getline(in, line)) {
+		++lineNumber;
+		size_t start = line.find_first_not_of(" \t");
+		if (start != std::string::npos && line.compare(start, 8, "#include") == 0) {
+			size_t open = line.find('"', start);
+			size_t close = (open == std::string::npos) ? open : line.find('"', open + 1);
+			if (close == std::string::npos) {
+				std::cerr << "ERROR: Malformed #include in " << filePath << ":" << lineNumber << "\n";
+				continue;
+			}
+			out << "#line 1 " << _sourceFiles.size() << "\n";
+			out << expandIncludes(directory + line.substr(open + 1, close - open - 1), depth + 1);
+			out << "#line " << lineNumber + 1 << " " << sourceIndex << "\n";
+			continue;
+		}
+		out << line << "\n";
+	}
+	return out.str();
 }
 
 void ComputeShader::checkCompileErrors(GLuint object, const std::string& type, const char* filename = nullptr) const
 {
 	GLint success;
-	glGetShaderiv(object,
-		type[0] == 'P' ? GL_LINK_STATUS : GL_COMPILE_STATUS,
-		&success);
+	if (type[0] == 'P') glGetProgramiv(object, GL_LINK_STATUS, &success);
+	else              glGetShaderiv(object, GL_COMPILE_STATUS, &success);
 	if (!success) {
 		char infoLog[1024];
 		if (type[0] == 'P') glGetProgramInfoLog(object, 1024, NULL, infoLog);
@@ -84,8 +380,13 @@ void ComputeShader::checkCompileErrors(GLuint object, const std::string& type, c
 		std::cerr
 			<< "ERROR::" << type
 			<< (filename ? std::string(" [") + filename + "]" : std::string())
-			<< "\n" << infoLog
-			<< "\n -- --------------------------------------------------- --\n";
+			<< "\n" << infoLog;
+		if (type[0] != 'P' && _sourceFiles.size() > 1) {
+			for (size_t i = 0; i < _sourceFiles.size(); ++i) {
+				std::cerr << "  source " << i << ": " << _sourceFiles[i] << "\n";
+			}
+		}
+		std::cerr << "\n -- --------------------------------------------------- --\n";
 	}
 }
 
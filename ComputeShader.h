@@ -4,6 +4,18 @@
 #include<glad/glad.h>
 #include <GLFW/glfw3.h>
 #include<string>
+#include<map>
+#include<utility>
+#include<vector>
+#include<functional>
+#include<future>
+
+// Name and value pairs injected as #define lines after the #version directive
+using ShaderDefines = std::vector<std::pair<std::string, std::string>>;
+
+// Makes a context that shares objects with the main one current on the calling
+// thread (true) or releases it (false)
+using CompileContext = std::function<void(bool current)>;
 
 class ComputeShader
 {
@@ -14,8 +26,45 @@ public:
 
 		void use() const;
 
+		// Switch to the program built with these defines, compiling it the
+		// first time this set of values is seen. Empty defines select the
+		// generic program.
+		void specialize(const ShaderDefines& defines);
+
+		// Builds the program with LOCAL_SIZE defined as this many invocations
+		// per workgroup, for shaders that size their layout with it. 0 keeps
+		// the size written in the shader. Combines with specialize().
+		void setWorkGroupSize(unsigned int size);
+
+		// local_size_x of the current program as linked
+		unsigned int workGroupSize() const;
+
+		// Directory for linked program binaries keyed by source, defines and
+		// driver, empty disables the cache. Set before creating shaders. The
+		// render programs share it, see ProgramBinaryCache.h.
+		static void setBinaryCacheDirectory(const std::string& directory);
+
+		// Programs are only submitted when a shader is created or specialized,
+		// their status is checked on first use. These let the driver compile
+		// them in parallel meanwhile: through GL_KHR_parallel_shader_compile,
+		// false when the driver lacks it, or else on worker threads that each
+		// link on their own shared context.
+		static bool enableParallelCompile(GLADloadproc load);
+		static void startCompileWorkers(std::vector<CompileContext> contexts);
+		static void stopCompileWorkers();
+
+		// True once every submitted program has finished, never blocks
+		bool isReady() const;
+
 		void dispatch(unsigned int groupsX, unsigned int groupsY = 1, unsigned int groupsZ = 1) const;
 
+		// Enough workgroups of the program's own size to cover 'invocations'
+		void dispatchFor(unsigned int invocations) const;
+
+		// Workgroup counts x, y, z read from 'buffer' at 'offset' when the
+		// dispatch runs, for sizes a previous shader wrote
+		void dispatchIndirect(unsigned int buffer, GLintptr offset) const;
+
 		void setInt(const char* name, int value) const;
 
 		void setFloat(const char* name, float value) const;
@@ -29,8 +78,35 @@ public:
 
 private:
 		unsigned int _id;
+		std::string _file;
+		std::string _source;
+		std::vector<std::string> _sourceFiles;      // file of each #line source string number
+		std::string _defines;                      // define block of the current program
+		std::map<std::string, unsigned int> _programs; // programs by define block
+		ShaderDefines _specialization;
+		unsigned int _workGroupSize;               // requested LOCAL_SIZE, 0 for the shader's own
+		mutable std::map<unsigned int, unsigned int> _workGroupSizes; // linked local_size_x by program
+
+		// A program whose compile and link were issued but not checked yet
+		struct PendingLink {
+			unsigned int shader;             // 0 when a worker links it
+			std::string cachePath;
+			std::shared_future<void> worker; // valid when a worker links it
+		};
+		mutable std::map<unsigned int, PendingLink> _pending;
+
+		void selectProgram();
+		unsigned int buildProgram(const std::string& defines);
+		unsigned int beginLink(unsigned int program, const std::string& code, const std::string& cachePath) const;
+		void endLink(unsigned int program, unsigned int shader, const std::string& cachePath) const;
+		void finishProgram(unsigned int program) const;
+
+		// Reads the file and expands #include "file" lines recursively, paths are
+		// relative to the including file. Each file gets its own #line source
+		// string number so compile errors can be traced back to it.
+		std::string loadShaderSource(const char* filePath);
 
-		std::string loadShaderSource(const char* filePath) const;
+		std::string expandIncludes(const std::string& filePath, int depth);
 
 		void checkCompileErrors(GLuint object, const std::string& type, const char* filename) const;
 };
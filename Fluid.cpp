@@ -1,25 +1,108 @@
 ﻿#include "Fluid.h"
+#include "MappedFile.h"
+#include "ParticleCache.h"
+#include "Trace.h"
+#include "WorkGroupTuner.h"
 #include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <glm/packing.hpp>
+
+
+// Polls a readback fence, or blocks until it passes, and deletes it once it has
+static bool FencePassed(GLsync& fence, bool wait) {
+    GLenum status;
+    if (wait) {
+        do {
+            status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+        } while (status == GL_TIMEOUT_EXPIRED);
+    }
+    else {
+        status = glClientWaitSync(fence, 0, 0);
+    }
+    if (status == GL_TIMEOUT_EXPIRED) return false;
+    glDeleteSync(fence);
+    fence = nullptr;
+    return true;
+}
 
 
 Fluid::Fluid(const unsigned int particleCount, const float particleRadius, const float mass, const float gravityAcceleration, const float collisionDamping, const float spacing, const float pressureMultiplier, const float targetDensity, const float smoothingRadius, const unsigned int hashSize, const float interactionRadius, const float interactionStrength, float viscosityStrength, float nearDensityMultiplier, float boundaryX, float boundaryY, float boundaryZ)
-    : _positions(particleCount, GL_DYNAMIC_DRAW),
-      _predictedPositions(particleCount, GL_DYNAMIC_DRAW),
-      _velocities(particleCount, GL_DYNAMIC_DRAW),
-      _densities(particleCount, GL_DYNAMIC_DRAW),
-      _nearDensities(particleCount, GL_DYNAMIC_DRAW),
-	  _spatialLookup(particleCount, GL_DYNAMIC_DRAW),
-      _startIndices(hashSize, GL_DYNAMIC_DRAW),
+    : _positions{ {_arena, particleCount}, {_arena, particleCount} },
+      _predictedPositions(_arena, particleCount),
+      _velocities{ {_arena, particleCount}, {_arena, particleCount} },
+      _densities(_arena, particleCount),
+      _nearDensities(_arena, particleCount),
+	  _spatialLookup(_arena, particleCount),
+      _cellRanges(_arena, hashSize),
       _simParams(1, GL_DYNAMIC_DRAW),
+      _changedFlags(_arena, particleCount),
+      _scanBlockSums(_arena, (particleCount + 511) / 512 + 1),
+      _changedLookup(_arena, particleCount),
+      _stableLookup(_arena, particleCount),
+      _sortDispatch(_arena, 3),
+      _changedCountReadback(1, GL_DYNAMIC_READ),
+      _blockTable(_arena, 1),
+      _blockSlots(_arena, 1),
+      _blockCount(_arena, 1),
+      _blockCountReadback(1, GL_DYNAMIC_READ),
+      _neighborOffsets(_arena, 27),
+      _quantizedPositions(_arena, 1),
+      _halfVelocities{ {_arena, 1}, {_arena, 1} },
+      _neighborStatsBuffer(4 * NEIGHBOR_STAT_BINS + 7),
+      _healthPartials((particleCount + 511) / 512),
+      _healthSlots{ {1, GL_DYNAMIC_READ}, {1, GL_DYNAMIC_READ}, {1, GL_DYNAMIC_READ} },
+      _checkpointStaging(1, GL_STREAM_READ),
+      _cacheSlots{ {1, GL_STREAM_READ}, {1, GL_STREAM_READ}, {1, GL_STREAM_READ} },
 
       _predictedPosShader("predicted_positions.comp"),
 	  _densityStep("density_step.comp"),
 	  _forceStep("force_step.comp"),
-      _fluidStep("fluid_step.comp"),
 	  _bitonicSortShader("bitonic_sort.comp"),
 	  _updateSpatialLookup("update_spatial_lookup.comp"),
-	  _buildStartIndices("build_start_indices.comp")
-	  
+	  _buildCellRanges("build_cell_ranges.comp"),
+	  _refreshSpatialKeys("refresh_spatial_keys.comp"),
+	  _prefixSum("prefix_sum.comp"),
+	  _scatterChangedEntries("scatter_changed_entries.comp"),
+	  _mergeSpatialLookup("merge_spatial_lookup.comp"),
+	  _allocateGridBlocks("allocate_grid_blocks.comp"),
+	  _quantizePositions("quantize_positions.comp"),
+	  _neighborStats("neighbor_stats.comp"),
+	  _healthMetrics("health_metrics.comp"),
+
+	  _incrementalSort(false),
+	  _resortThreshold(0.2f),
+	  _changedCountFence(nullptr),
+	  _lastChangedCount(0),
+	  _blockCountFence(nullptr),
+	  _lastBlockCount(0),
+	  _spatialLookupValid(false),
+	  _stateIndex(0),
+	  _specializeShaders(false),
+	  _stepCount(0),
+	  _hashTargetCollisionRate(0.0f),
+	  _hashMemoryBudget(0),
+	  _hashRetuneInterval(0),
+	  _hashTunedStep(0),
+	  _healthMonitoring(false),
+	  _healthFences{},
+	  _healthSteps{},
+	  _healthIssued(0),
+	  _healthCollected(0),
+	  _latestHealth{},
+	  _healthLog(nullptr),
+	  _checkpointFence(nullptr),
+	  _particleCache(nullptr),
+	  _cacheInterval(1),
+	  _cacheFences{},
+	  _cacheSteps{},
+	  _cacheIssued(0),
+	  _cacheCollected(0)
 {
 	//Initialize simulation parameters
     _params.dt = 0.016f;
@@ -41,12 +124,22 @@ Fluid::Fluid(const unsigned int particleCount, const float particleRadius, const
 
 	_params.particleCount = particleCount;
 	_params.hashSize = hashSize;
+	_params.hashMixing = 0;
 	_params.spacing = spacing;
 	_params.particleRadius = particleRadius;
 	_params.boundaryX = boundaryX;
 	_params.boundaryY = boundaryY;
 	_params.boundaryZ = boundaryZ;
 
+	_params.gridMode = GRID_HASHED;
+	_params.blockTableSize = 1;
+	_params.blockCapacity = 0;
+
+    _params.packedDensities = 0;
+    _params.quantizePositions = 0;
+    _params.useHalfVelocities = 0;
+    SetCellSizeFactor(1);
+
     _simParams.upload(std::vector<SimulationParameters>{_params});
 
     // Initialize positions in a grid
@@ -66,97 +159,253 @@ Fluid::Fluid(const unsigned int particleCount, const float particleRadius, const
         initialPositions[i] = glm::vec4(fx, fy, fz, 0.0f);
     }
 
-    _positions.upload(initialPositions);
+    for (int s = 0; s < 2; ++s) {
+        _positions[s].upload(initialPositions);
+        _velocities[s].upload(std::vector<glm::vec4>(particleCount, glm::vec4(0.0f)));
+    }
     _predictedPositions.upload(initialPositions);
-    _velocities.upload(std::vector<glm::vec4>(particleCount, glm::vec4(0.0f)));
     _densities.upload(std::vector<float>(particleCount, 0.0f));
     _nearDensities.upload(std::vector<float>(particleCount, 0.0f));
 	_spatialLookup.upload(std::vector<Entry>(particleCount, Entry{ 0, 0 }));
-    _startIndices.upload(std::vector<unsigned int>(hashSize, MAX_INT));
+    _cellRanges.clear();
+}
+
+unsigned int Fluid::SortableParticleCount(unsigned int count) {
+    unsigned int sortable = 1;
+    while (sortable < count && sortable <= MAX_INT / 2) sortable *= 2;
+    return sortable >= count ? sortable : 0;
+}
+
+// Readbacks still in flight are dropped, not collected: the health log and the
+// particle cache may already be gone
+Fluid::~Fluid() {
+    FinishCheckpoint();
+    if (_changedCountFence) glDeleteSync(_changedCountFence);
+    if (_blockCountFence) glDeleteSync(_blockCountFence);
+    for (; _healthCollected < _healthIssued; ++_healthCollected) glDeleteSync(_healthFences[_healthCollected % HEALTH_METRICS_LATENCY]);
+    for (; _cacheCollected < _cacheIssued; ++_cacheCollected) glDeleteSync(_cacheFences[_cacheCollected % PARTICLE_CACHE_LATENCY]);
 }
 
 void Fluid::Update(float dt) {
 	if (_params.isPaused) return; // Skip update if paused
+    TRACE_ZONE("Fluid::Update");
+
+    if (_hashRetuneInterval && _stepCount > 0 && _stepCount % _hashRetuneInterval == 0 && _hashTunedStep != _stepCount) {
+        TuneHashSize(_hashTargetCollisionRate, _hashMemoryBudget);
+    }
 
+    RefreshSpecialization();
+    CollectHealthMetrics(false);
+    CollectCheckpoint(false);
+    CollectCacheFrames(false);
     _simParams.upload(std::vector<SimulationParameters>{_params});
     
 
-    const int groupSize = 512;
-    int numGroups = (_positions.count() + groupSize - 1) / groupSize;
+    const GLuint N = _params.particleCount;
+    const unsigned int read = _stateIndex;
+    const unsigned int write = _stateIndex ^ 1u;
 
-	// Step 0: Predict positions based on velocities
-	_predictedPosShader.use();
-	_positions.bindTo(1);
-	_predictedPositions.bindTo(2);
-	_velocities.bindTo(3);
-	_simParams.bindTo(8);
-    _predictedPosShader.dispatch(numGroups);
-	_predictedPosShader.wait();
+    const bool rebuildLookup = !(_incrementalSort && _spatialLookupValid);
+    const bool fusedKeys = rebuildLookup && _params.gridMode == GRID_HASHED;
 
-    // Step 1: Update spatial lookup keys,
+    // Each pass declares the buffers it reads and writes, the frame graph
+    // places the barriers between them and runs independent passes together.
+    // The parameter block is only written by uploads, which GL orders itself.
 
-    _updateSpatialLookup.use();
-	_predictedPositions.bindTo(2);
-    _spatialLookup.bindTo(6);
-    _simParams.bindTo(8);
-    _updateSpatialLookup.dispatch(numGroups);
-	_updateSpatialLookup.wait();
+	// Step 0: Predict positions based on velocities, and the hashed keys
+	// when the lookup is rebuilt
+    std::vector<FrameGraph::Resource> predictWrites = { &_predictedPositions };
+    if (fusedKeys) predictWrites.push_back(&_spatialLookup);
+    _frameGraph.addPass("predict", PassKind::Compute,
+        { &_positions[read], &_velocities[read] },
+        predictWrites,
+        [this, read, fusedKeys, N]() {
+            _predictedPosShader.use();
+            _predictedPosShader.setUint("u_writeKeys", fusedKeys);
+            _positions[read].bindTo(1);
+            _predictedPositions.bindTo(2);
+            _velocities[read].bindTo(3);
+            _spatialLookup.bindTo(6);
+            _simParams.bindTo(8);
+            _predictedPosShader.dispatchFor(N);
+        });
 
-    // Step 2: Sort spatial lookup
-    SortSpatialLookup();
+    // Step 0b: Allocate sparse grid blocks for newly occupied space, growing
+    // the block table resizes the cell ranges
+    if (_params.gridMode == GRID_SPARSE) {
+        _frameGraph.addPass("allocate grid blocks", PassKind::Compute,
+            { &_predictedPositions },
+            { &_blockTable, &_blockSlots, &_blockCount, &_blockCountReadback, &_cellRanges },
+            [this]() { AllocateGridBlocks(); });
+    }
+
+    if (!rebuildLookup) {
+        // Step 1-2: Refresh keys in last frame's order and repair it
+        _frameGraph.addPass("incremental sort", PassKind::Compute,
+            { &_predictedPositions, &_blockTable, &_blockSlots },
+            { &_spatialLookup, &_changedFlags, &_scanBlockSums, &_changedLookup, &_stableLookup, &_sortDispatch, &_changedCountReadback },
+            [this]() { IncrementalSortSpatialLookup(); });
+    }
+    else {
+        // Step 1: Update spatial lookup keys, already done in step 0 unless
+        // they depend on the sparse blocks allocated since
+        if (!fusedKeys) {
+            _frameGraph.addPass("spatial keys", PassKind::Compute,
+                { &_predictedPositions, &_blockTable, &_blockSlots },
+                { &_spatialLookup },
+                [this, N]() {
+                    _updateSpatialLookup.use();
+                    _predictedPositions.bindTo(2);
+                    _spatialLookup.bindTo(6);
+                    _simParams.bindTo(8);
+                    _blockTable.bindTo(13);
+                    _blockSlots.bindTo(14);
+                    _updateSpatialLookup.dispatchFor(N);
+                });
+        }
+
+        // Step 2: Sort spatial lookup
+        _frameGraph.addPass("sort", PassKind::Compute,
+            { &_spatialLookup },
+            { &_spatialLookup },
+            [this]() { SortSpatialLookup(); });
+        _spatialLookupValid = true;
+    }
+
+	// Step 3: Clear cell ranges
+    _frameGraph.addPass("clear cell ranges", PassKind::Transfer,
+        {},
+        { &_cellRanges },
+        [this]() { _cellRanges.clear(); });
+
+	// Step 4: Build [start, end) ranges per key
+    _frameGraph.addPass("build cell ranges", PassKind::Compute,
+        { &_spatialLookup },
+        { &_cellRanges },
+        [this, N]() {
+            _buildCellRanges.use();
+            _spatialLookup.bindTo(6);
+            _cellRanges.bindTo(7);
+            _simParams.bindTo(8);
+            _buildCellRanges.dispatchFor(N);
+        });
+
+	// Step 4b: Quantize predicted positions for the neighbor loops
+	if (_params.quantizePositions) {
+        _frameGraph.addPass("quantize positions", PassKind::Compute,
+            { &_predictedPositions },
+            { &_quantizedPositions },
+            [this, N]() {
+                _quantizePositions.use();
+                _predictedPositions.bindTo(2);
+                _simParams.bindTo(8);
+                _quantizedPositions.bindTo(17);
+                _quantizePositions.dispatchFor(N);
+            });
+	}
+
+	// Step 5: Calculate densities, packed densities land in the w lanes
+    std::vector<FrameGraph::Resource> densityWrites = { &_densities, &_nearDensities };
+    if (_params.packedDensities) densityWrites.insert(densityWrites.end(), { &_predictedPositions, &_velocities[read] });
+    _frameGraph.addPass("densities", PassKind::Compute,
+        { &_predictedPositions, &_spatialLookup, &_cellRanges, &_blockTable, &_blockSlots, &_neighborOffsets, &_quantizedPositions },
+        densityWrites,
+        [this]() { CalculateDensities(); });
+
+	// Step 6: Calculate forces and integrate, neighbors are read from the
+	// current state and the new positions and velocities go to the other copy
+    _frameGraph.addPass("forces", PassKind::Compute,
+        { &_positions[read], &_predictedPositions, &_velocities[read], &_densities, &_nearDensities, &_spatialLookup, &_cellRanges,
+          &_blockTable, &_blockSlots, &_neighborOffsets, &_quantizedPositions, &_halfVelocities[read] },
+        { &_positions[write], &_velocities[write], &_halfVelocities[write] },
+        [this, read, write, N]() {
+            _forceStep.use();
+            _positions[read].bindTo(1);
+            _predictedPositions.bindTo(2);
+            _velocities[read].bindTo(3);
+            _densities.bindTo(4);
+            _nearDensities.bindTo(5);
+            _spatialLookup.bindTo(6);
+            _cellRanges.bindTo(7);
+            _simParams.bindTo(8);
+            _blockTable.bindTo(13);
+            _blockSlots.bindTo(14);
+            _neighborOffsets.bindTo(16);
+            _quantizedPositions.bindTo(17);
+            _halfVelocities[read].bindTo(18);
+            _positions[write].bindTo(19);
+            _velocities[write].bindTo(20);
+            _halfVelocities[write].bindTo(21);
+            _forceStep.dispatchFor(N);
+        });
+
+	// Step 6b: Reduce the new state to the health metrics
+	if (_healthMonitoring) {
+        _frameGraph.addPass("health metrics", PassKind::Compute,
+            { &_positions[write], &_predictedPositions, &_velocities[write], &_densities },
+            { &_healthPartials, &_healthSlots[_healthIssued % HEALTH_METRICS_LATENCY] },
+            [this, write]() {
+                _positions[write].bindTo(1);
+                _velocities[write].bindTo(3);
+                MeasureHealth();
+            });
+	}
+
+	// Step 6c: Copy the new state for the particle cache
+	if (_particleCache && (_stepCount + 1) % _cacheInterval == 0) {
+        _frameGraph.addPass("particle cache", PassKind::Transfer,
+            { &_positions[write], &_velocities[write] },
+            { &_cacheSlots[_cacheIssued % PARTICLE_CACHE_LATENCY] },
+            [this, write]() { CaptureCacheFrame(write); });
+	}
 
-	// Step 3: Clear start indices
-    _startIndices.upload(std::vector<unsigned int>(_params.hashSize, MAX_INT));
- 
-	// Step 4: Update start indices
-    _buildStartIndices.use();
+    _frameGraph.execute();
+
+    // Step 7: The written copy becomes the current state, the old one is
+    // free to be overwritten next step
+    _stateIndex = write;
+    ++_stepCount;
+}
+
+
+bool Fluid::UpdatePass(const char* name, float dt) {
+    const unsigned int state = _stateIndex;
+    const unsigned int stepCount = _stepCount;
+    _frameGraph.setPassFilter(name);
+    Update(dt);
+    _frameGraph.setPassFilter(nullptr);
+    _stateIndex = state;
+    _stepCount = stepCount;
+    return _frameGraph.passesRun() > 0;
+}
+
+void Fluid::CalculateDensities() {
+    _densityStep.use();
+    _predictedPositions.bindTo(2);
+    _velocities[_stateIndex].bindTo(3);
+    _densities.bindTo(4);
+    _nearDensities.bindTo(5);
     _spatialLookup.bindTo(6);
-    _startIndices.bindTo(7);
+    _cellRanges.bindTo(7);
     _simParams.bindTo(8);
-    _buildStartIndices.dispatch(numGroups);
-	_buildStartIndices.wait();
-
-	// Step 5: Calculate densities
-	_densityStep.use();
-	_predictedPositions.bindTo(2);
-	_densities.bindTo(4);
-	_nearDensities.bindTo(5);
-	_spatialLookup.bindTo(6);
-	_startIndices.bindTo(7);
-	_simParams.bindTo(8);
-	_densityStep.dispatch(numGroups);
-	_densityStep.wait();
-
-	// Step 6: Calculate forces
-	_forceStep.use();
-	_positions.bindTo(1);
-	_predictedPositions.bindTo(2);
-	_velocities.bindTo(3);
-	_densities.bindTo(4);
-	_nearDensities.bindTo(5);
-	_spatialLookup.bindTo(6);
-	_startIndices.bindTo(7);
-	_simParams.bindTo(8);
-	_forceStep.dispatch(numGroups);
-	_forceStep.wait();
-
-	// Step 7: Update positions and velocities
-	_fluidStep.use();
-    _positions.bindTo(1);
-    _velocities.bindTo(3);
-    _simParams.bindTo(8);
-    _fluidStep.dispatch(numGroups);
-    _fluidStep.wait();
+    _blockTable.bindTo(13);
+    _blockSlots.bindTo(14);
+    _neighborOffsets.bindTo(16);
+    _quantizedPositions.bindTo(17);
+    _densityStep.dispatchFor(_params.particleCount);
 }
 
 
 void Fluid::SortSpatialLookup() {
-    GLuint N = _params.particleCount;
-    GLuint localSize = 256;
-    const GLuint groups = (N + localSize - 1) / localSize;       
+    SortEntries(_spatialLookup, _params.particleCount);
+}
+
+
+void Fluid::SortEntries(ArenaBuffer<Entry>& entries, GLuint count, const ArenaBuffer<unsigned int>* groups) {
+    GLuint N = count;
 
     _bitonicSortShader.use();
-    _spatialLookup.bindTo(6);
+    entries.bindTo(6);
 
     _bitonicSortShader.setUint("u_N", N);
 
@@ -166,16 +415,189 @@ void Fluid::SortSpatialLookup() {
             _bitonicSortShader.setUint("u_stride", stride);
 
             // ← dispatch here, not after the loops
-            _bitonicSortShader.dispatch(groups, 1, 1);
+            if (groups) _bitonicSortShader.dispatchIndirect(groups->getID(), groups->getOffset());
+            else _bitonicSortShader.dispatchFor(N);
             _bitonicSortShader.wait();
         }
     }
 }
 
 
+// Exclusive prefix sum in place, the total is left at _scanBlockSums[numBlocks],
+// returns numBlocks
+GLuint Fluid::PrefixSum(ArenaBuffer<unsigned int>& data, GLuint count) {
+    const GLuint groupSize = _prefixSum.workGroupSize();
+    const GLuint numBlocks = (count + groupSize - 1) / groupSize;
+
+    _prefixSum.use();
+    data.bindTo(9);
+    _scanBlockSums.bindTo(10);
+
+    _prefixSum.setUint("u_N", count);
+    _prefixSum.setUint("u_pass", 0);
+    _prefixSum.dispatch(numBlocks);
+    _prefixSum.wait();
+
+    _prefixSum.setUint("u_N", numBlocks);
+    _prefixSum.setUint("u_pass", 1);
+    _prefixSum.dispatch(1);
+    _prefixSum.wait();
+
+    _prefixSum.setUint("u_N", count);
+    _prefixSum.setUint("u_pass", 2);
+    _prefixSum.dispatch(numBlocks);
+    _prefixSum.wait();
+    return numBlocks;
+}
+
+
+// Copies one counter to a readback buffer behind a fence and picks the last
+// copy up once its fence has passed, so value lags a step or more behind
+void Fluid::ReadCounterLate(const ArenaBuffer<unsigned int>& counter, size_t index, SSBO<unsigned int>& readback, GLsync& fence, unsigned int& value) {
+    if (fence) {
+        if (!FencePassed(fence, false)) return;
+        value = readback.download(0, 1)[0];
+    }
+
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    glBindBuffer(GL_COPY_READ_BUFFER, counter.getID());
+    glBindBuffer(GL_COPY_WRITE_BUFFER, readback.getID());
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, counter.getOffset() + GLintptr(index * sizeof(unsigned int)), 0, sizeof(unsigned int));
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+
+// Between frames only a few particles change cell, so instead of rebuilding the
+// lookup we re-key it in place, sort just the changed entries and merge them back.
+// Nothing waits for the changed count: the shaders read it where the prefix sum
+// left it and the sort is dispatched indirectly. The count read back from an
+// earlier step picks a full sort instead when too many entries changed.
+void Fluid::IncrementalSortSpatialLookup() {
+    const GLuint N = _params.particleCount;
+
+    // Refresh keys and flag the entries whose key changed
+    _refreshSpatialKeys.use();
+    _predictedPositions.bindTo(2);
+    _spatialLookup.bindTo(6);
+    _simParams.bindTo(8);
+    _changedFlags.bindTo(9);
+    _blockTable.bindTo(13);
+    _blockSlots.bindTo(14);
+    _refreshSpatialKeys.dispatchFor(N);
+    _refreshSpatialKeys.wait();
+
+    // Slot of each changed entry, the total lands at _scanBlockSums[numBlocks]
+    const GLuint numBlocks = PrefixSum(_changedFlags, N);
+    ReadCounterLate(_scanBlockSums, numBlocks, _changedCountReadback, _changedCountFence, _lastChangedCount);
+
+    if (_lastChangedCount > N * _resortThreshold) {
+        SortSpatialLookup();
+        return;
+    }
+
+    // Split into changed and stable entries, pad the changed ones and size the
+    // sort's dispatch to them
+    _scatterChangedEntries.use();
+    _spatialLookup.bindTo(6);
+    _changedFlags.bindTo(9);
+    _scanBlockSums.bindTo(10);
+    _changedLookup.bindTo(11);
+    _stableLookup.bindTo(12);
+    _sortDispatch.bindTo(25);
+    _scatterChangedEntries.setUint("u_N", N);
+    _scatterChangedEntries.setUint("u_countIndex", numBlocks);
+    _scatterChangedEntries.setUint("u_sortGroupSize", _bitonicSortShader.workGroupSize());
+    _scatterChangedEntries.dispatchFor(N);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+
+    // Sort only the changed entries, the stages past their padded count find
+    // them sorted against the pads and leave them in place
+    SortEntries(_changedLookup, N, &_sortDispatch);
+
+    // Merge them back into the lookup
+    _mergeSpatialLookup.use();
+    _spatialLookup.bindTo(6);
+    _scanBlockSums.bindTo(10);
+    _changedLookup.bindTo(11);
+    _stableLookup.bindTo(12);
+    _mergeSpatialLookup.setUint("u_N", N);
+    _mergeSpatialLookup.setUint("u_countIndex", numBlocks);
+    _mergeSpatialLookup.dispatchFor(N);
+    _mergeSpatialLookup.wait();
+}
+
+
+// Inserts the blocks touched this frame. The block count comes back a step
+// late, the step only waits for its own count once that came close to the
+// capacity. On overflow the table is first cleared of blocks the fluid has
+// left, then grown, and the allocation runs again after each.
+void Fluid::AllocateGridBlocks() {
+    const int attempts = 3;
+    for (int attempt = 0; ; ++attempt) {
+        _allocateGridBlocks.use();
+        _predictedPositions.bindTo(2);
+        _simParams.bindTo(8);
+        _blockTable.bindTo(13);
+        _blockSlots.bindTo(14);
+        _blockCount.bindTo(15);
+        _allocateGridBlocks.dispatchFor(_params.particleCount);
+        _allocateGridBlocks.wait();
+
+        if (attempt == 0) {
+            ReadCounterLate(_blockCount, 0, _blockCountReadback, _blockCountFence, _lastBlockCount);
+            if (_lastBlockCount < _params.blockCapacity - _params.blockCapacity / 4) return;
+        }
+
+        const GLuint blockCount = _blockCount.download(0, 1)[0];
+        if (blockCount <= _params.blockCapacity) return;
+        if (attempt == attempts - 1) {
+            std::cerr << "Sparse grid needs " << blockCount << " blocks but holds " << _params.blockCapacity
+                      << ", particles in the missing blocks find no neighbors this step\n";
+            return;
+        }
+
+        if (attempt == 0) ResetGridBlocks();
+        else ResizeGridBlocks(blockCount * 2);
+        _simParams.upload(std::vector<SimulationParameters>{_params});
+    }
+}
+
+
+void Fluid::ResizeGridBlocks(GLuint capacity) {
+    GLuint tableSize = 1;
+    while (tableSize < capacity * 2) tableSize <<= 1; // keep the load factor under 0.5
+
+    _params.blockCapacity = capacity;
+    _params.blockTableSize = tableSize;
+    _blockTable.resize(tableSize);
+    _blockSlots.resize(tableSize);
+    _cellRanges.resize(capacity * GRID_BLOCK_CELLS);
+    ResetGridBlocks();
+}
+
+
+// Slots change on reset, so last frame's order can no longer be reused. Counts
+// of the old table still in flight are dropped, the steps check their own
+// until one of the new table comes back.
+void Fluid::ResetGridBlocks() {
+    _blockTable.clear();
+    _blockCount.clear();
+    _spatialLookupValid = false;
+    if (_blockCountFence) glDeleteSync(_blockCountFence);
+    _blockCountFence = nullptr;
+    _lastBlockCount = _params.blockCapacity;
+}
+
+
+// Only the current state is bound, which the next Update reads but does not
+// overwrite, so it can be drawn while the next step runs
 void Fluid::BindRenderBuffers() {
-    _positions.bindTo(1);
-    _velocities.bindTo(3);
+    _frameGraph.prepareDraw({ &_positions[_stateIndex], &_velocities[_stateIndex], &_halfVelocities[_stateIndex] });
+    _positions[_stateIndex].bindTo(1);
+    _velocities[_stateIndex].bindTo(3);
+    _halfVelocities[_stateIndex].bindTo(18);
 }
 
 void Fluid::SetIsInteracting(bool state) { _params.isInteracting = state; }
@@ -204,6 +626,728 @@ void Fluid::SetViscosityStrength(float viscosityStrength) { _params.viscosityStr
 float Fluid::GetNearDensityMultiplier() { return _params.nearDensityMultiplier; }
 void Fluid::SetNearDensityMultiplier(float nearDensityMultiplier) { _params.nearDensityMultiplier = nearDensityMultiplier; }
 
+void Fluid::SetIncrementalSort(bool enabled) { _incrementalSort = enabled; }
+void Fluid::SetResortThreshold(float fraction) { _resortThreshold = std::clamp(fraction, 0.0f, 1.0f); }
+
+// Cells are smoothingRadius / cellsPerRadius wide. Only neighbor cells whose
+// closest point to the center cell is within the smoothing radius are searched,
+// which trims the search volume from 27h^3 to about 15.6h^3 (2) or 12.4h^3 (3).
+void Fluid::SetCellSizeFactor(unsigned int cellsPerRadius) {
+    const int reach = static_cast<int>(std::clamp(cellsPerRadius, 1u, 3u));
+    const float cellSize = _params.smoothingRadius / reach;
+
+    std::vector<glm::ivec4> offsets;
+    for (int z = -reach; z <= reach; ++z) {
+        for (int y = -reach; y <= reach; ++y) {
+            for (int x = -reach; x <= reach; ++x) {
+                glm::vec3 gap = glm::max(glm::vec3(std::abs(x), std::abs(y), std::abs(z)) - 1.0f, 0.0f) * cellSize;
+                if (glm::dot(gap, gap) <= _params.smoothingRadius * _params.smoothingRadius) {
+                    offsets.push_back(glm::ivec4(x, y, z, 0));
+                }
+            }
+        }
+    }
+
+    _params.cellSize = cellSize;
+    _params.cellSizeFactor = reach;
+    _params.neighborOffsetCount = static_cast<uint32_t>(offsets.size());
+    _neighborOffsets.upload(offsets);
+    _spatialLookupValid = false;
+
+    if (_params.quantizePositions && GetDomainCellCount() > QUANTIZED_MAX_DOMAIN_CELLS) {
+        std::cerr << "Quantized positions turned off, " << GetDomainCellCount() << " domain cells need more than 16-bit tags\n";
+        SetQuantizedPositions(false);
+    }
+}
+
+unsigned int Fluid::GetCellSizeFactor() { return _params.cellSizeFactor; }
+unsigned int Fluid::GetNeighborCellCount() { return _params.neighborOffsetCount; }
+
+// Stores density in predictedPositions.w and near density in velocities.w, the
+// separate buffers are shrunk to a single element while packed
+void Fluid::SetPackedDensities(bool packed) {
+    _params.packedDensities = packed;
+    const size_t count = packed ? 1 : _params.particleCount;
+    _densities.upload(std::vector<float>(count, 0.0f));
+    _nearDensities.upload(std::vector<float>(count, 0.0f));
+}
+
+bool Fluid::SetQuantizedPositions(bool quantized) {
+    if (quantized && GetDomainCellCount() > QUANTIZED_MAX_DOMAIN_CELLS) {
+        std::cerr << "Quantized positions need at most " << QUANTIZED_MAX_DOMAIN_CELLS << " domain cells, this one has "
+                  << GetDomainCellCount() << ", use a lower cell size factor\n";
+        quantized = false;
+    }
+    _params.quantizePositions = quantized;
+    _quantizedPositions.resize(quantized ? _params.particleCount : 1);
+    return _params.quantizePositions != 0;
+}
+
+// Same grid as DomainCellTag in fluid_common.glsl
+uint64_t Fluid::GetDomainCellCount() {
+    const glm::vec3 bounds(_params.boundaryX, _params.boundaryY, _params.boundaryZ);
+    const glm::vec3 cells = glm::floor(bounds / _params.cellSize) - glm::floor(-bounds / _params.cellSize) + 1.0f;
+    return uint64_t(cells.x) * uint64_t(cells.y) * uint64_t(cells.z);
+}
+
+std::vector<float> Fluid::ReadDensities() {
+    if (!_params.packedDensities) return _densities.download(0, _params.particleCount);
+
+    std::vector<float> densities;
+    for (const glm::vec4& p : _predictedPositions.download(0, _params.particleCount)) densities.push_back(p.w);
+    return densities;
+}
+
+// Compares the quantized positions of the last step against the float ones and
+// reruns the density pass both ways to see what the error does to the densities.
+// Reads everything back, meant for tuning rather than every frame.
+QuantizationError Fluid::MeasureQuantizationError() {
+    QuantizationError error = {};
+    if (!_params.quantizePositions) return error;
+
+    const size_t N = _params.particleCount;
+    const float cellSize = _params.cellSize;
+    std::vector<glm::vec4> predicted = _predictedPositions.download(0, N);
+    std::vector<glm::uvec2> quantized = _quantizedPositions.download(0, N);
+
+    double sumSqrPosition = 0.0;
+    for (size_t i = 0; i < N; ++i) {
+        glm::vec3 p = glm::vec3(predicted[i]);
+        glm::vec3 local = glm::vec3(quantized[i].x & 0xFFFFu, quantized[i].x >> 16, quantized[i].y & 0xFFFFu) / 65535.0f;
+
+        // The GPU may round the cell differently right at a cell border, use the closest one
+        glm::vec3 decoded;
+        for (int axis = 0; axis < 3; ++axis) {
+            float cell = std::floor(p[axis] / cellSize);
+            decoded[axis] = (cell + local[axis]) * cellSize;
+            for (float d : { -1.0f, 1.0f }) {
+                float candidate = (cell + d + local[axis]) * cellSize;
+                if (std::abs(candidate - p[axis]) < std::abs(decoded[axis] - p[axis])) decoded[axis] = candidate;
+            }
+        }
+
+        float e = glm::length(decoded - p);
+        error.maxPositionError = std::max(error.maxPositionError, e);
+        sumSqrPosition += double(e) * e;
+    }
+    error.rmsPositionError = float(std::sqrt(sumSqrPosition / N));
+
+    _params.quantizePositions = 0;
+    _simParams.upload(std::vector<SimulationParameters>{_params});
+    CalculateDensities();
+    std::vector<float> reference = ReadDensities();
+
+    _params.quantizePositions = 1;
+    _simParams.upload(std::vector<SimulationParameters>{_params});
+    CalculateDensities();
+    std::vector<float> densities = ReadDensities();
+
+    double sumSqrDensity = 0.0;
+    for (size_t i = 0; i < N; ++i) {
+        float e = std::abs(densities[i] - reference[i]) / std::max(reference[i], EPSILON);
+        error.maxDensityError = std::max(error.maxDensityError, e);
+        sumSqrDensity += double(e) * e;
+    }
+    error.rmsDensityError = float(std::sqrt(sumSqrDensity / N));
+    return error;
+}
+
+// Walks the neighbor cells of every particle like the density pass and every
+// occupied bucket of the lookup, then reads the counts back. Waits for the GPU,
+// meant for tuning the hash and cell sizes rather than every frame.
+NeighborStatistics Fluid::MeasureNeighborStatistics() {
+    const GLuint N = _params.particleCount;
+
+    _neighborStatsBuffer.clear();
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+    _neighborStats.use();
+    _predictedPositions.bindTo(2);
+    _spatialLookup.bindTo(6);
+    _cellRanges.bindTo(7);
+    _simParams.bindTo(8);
+    _blockTable.bindTo(13);
+    _blockSlots.bindTo(14);
+    _neighborOffsets.bindTo(16);
+    _quantizedPositions.bindTo(17);
+    _neighborStatsBuffer.bindTo(22);
+    for (unsigned int pass = 0; pass < 2; ++pass) {
+        _neighborStats.setUint("u_pass", pass);
+        _neighborStats.dispatchFor(N);
+    }
+
+    std::vector<unsigned int> counts = _neighborStatsBuffer.download(0, _neighborStatsBuffer.count());
+    auto histogram = [&](unsigned int index) {
+        return std::vector<unsigned int>(counts.begin() + index * NEIGHBOR_STAT_BINS, counts.begin() + (index + 1) * NEIGHBOR_STAT_BINS);
+    };
+    const unsigned int* totals = counts.data() + 4 * NEIGHBOR_STAT_BINS;
+
+    NeighborStatistics stats;
+    stats.candidates = histogram(0);
+    stats.neighbors = histogram(1);
+    stats.occupiedCells = histogram(2);
+    stats.bucketLoad = histogram(3);
+    stats.meanCandidates = float(totals[0]) / N;
+    stats.meanNeighbors = float(totals[1]) / N;
+    stats.meanOccupiedCells = float(totals[2]) / N;
+    stats.foreignCandidateRate = totals[0] ? float(totals[3]) / totals[0] : 0.0f;
+    stats.occupiedBuckets = totals[4];
+    stats.meanBucketLoad = totals[4] ? float(N) / totals[4] : 0.0f;
+    stats.collidedBucketRate = totals[4] ? float(totals[5]) / totals[4] : 0.0f;
+    stats.mergedCells = totals[6];
+    return stats;
+}
+
+// Keeps an fp16 copy of the velocities next to the fp32 master for the
+// viscosity neighbor reads and the vertex shader
+void Fluid::SetHalfVelocities(bool enabled) {
+    _params.useHalfVelocities = enabled;
+    for (int s = 0; s < 2; ++s) {
+        _halfVelocities[s].resize(enabled ? _params.particleCount : 1);
+        _halfVelocities[s].clear();
+    }
+    if (!enabled) return;
+
+    // The copy is written at the end of each step, seed it from the current state
+    std::vector<glm::vec4> velocities = _velocities[_stateIndex].download(0, _params.particleCount);
+    std::vector<glm::uvec2> encoded(velocities.size());
+    for (size_t i = 0; i < velocities.size(); ++i) {
+        encoded[i] = glm::uvec2(glm::packHalf2x16(glm::vec2(velocities[i].x, velocities[i].y)),
+                                glm::packHalf2x16(glm::vec2(velocities[i].z, 0.0f)));
+    }
+    _halfVelocities[_stateIndex].upload(encoded);
+}
+
+bool Fluid::GetHalfVelocities() { return _params.useHalfVelocities != 0; }
+
+// Bakes the parameters that only change on reconfiguration into the shaders
+// that use them through fluid_common.glsl, each set of values is compiled
+// once and cached
+void Fluid::SetSpecializedShaders(bool enabled) {
+    _specializeShaders = enabled;
+    RefreshSpecialization();
+}
+
+void Fluid::SetProfiler(GpuProfiler* profiler) { _frameGraph.setProfiler(profiler); }
+
+// Each kernel is timed through the frame graph pass that runs it and keeps its
+// size when that pass is off. The incremental sort finds nothing changed on a
+// repeated state, so only its key refresh is tuned there. The bitonic sort does
+// the same work on any input and is timed on the whole lookup.
+void Fluid::TuneWorkGroupSizes(WorkGroupTuner& tuner) {
+    const struct {
+        const char* kernel;
+        const char* pass;
+        ComputeShader* shader;
+    } kernels[] = {
+        { "predicted_positions", "predict", &_predictedPosShader },
+        { "allocate_grid_blocks", "allocate grid blocks", &_allocateGridBlocks },
+        { "refresh_spatial_keys", "incremental sort", &_refreshSpatialKeys },
+        { "update_spatial_lookup", "spatial keys", &_updateSpatialLookup },
+        { "build_cell_ranges", "build cell ranges", &_buildCellRanges },
+        { "quantize_positions", "quantize positions", &_quantizePositions },
+        { "density_step", "densities", &_densityStep },
+        { "force_step", "forces", &_forceStep },
+    };
+
+    for (const auto& entry : kernels) {
+        const char* pass = entry.pass;
+        // Each kernel is timed on the state of a full step, like the benchmark.
+        // A rebuilt lookup is left unsorted by the key passes, the neighbor
+        // loops of the passes after them would do unrepresentative work on it.
+        if (!tuner.cached(entry.kernel, _params.particleCount)) Update(_params.dt);
+        tuner.tune(entry.kernel, _params.particleCount, *entry.shader, [this, pass]() { return UpdatePass(pass, _params.dt); });
+    }
+    if (!tuner.cached("bitonic_sort", _params.particleCount)) Update(_params.dt);
+    tuner.tune("bitonic_sort", _params.particleCount, _bitonicSortShader, [this]() {
+        SortSpatialLookup();
+        return true;
+    });
+}
+
+// Positions and velocities are bound by the caller. The slot is read back once
+// its fence has passed, a few steps later, so the GPU never waits for the CPU.
+void Fluid::MeasureHealth() {
+    // Every slot still in flight, wait for the oldest to free one
+    if (_healthIssued - _healthCollected == HEALTH_METRICS_LATENCY) CollectHealthMetrics(true);
+    const unsigned int slot = _healthIssued % HEALTH_METRICS_LATENCY;
+    const GLuint groupSize = _healthMetrics.workGroupSize();
+    const GLuint numGroups = (_params.particleCount + groupSize - 1) / groupSize;
+
+    _healthMetrics.use();
+    _predictedPositions.bindTo(2);
+    _densities.bindTo(4);
+    _simParams.bindTo(8);
+    _healthPartials.bindTo(23);
+    _healthSlots[slot].bindTo(24);
+    _healthMetrics.setUint("u_pass", 0);
+    _healthMetrics.dispatch(numGroups);
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    _healthMetrics.setUint("u_pass", 1);
+    _healthMetrics.setUint("u_groups", numGroups);
+    _healthMetrics.dispatch(1);
+
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    _healthFences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    _healthSteps[slot] = _stepCount;
+    ++_healthIssued;
+}
+
+// Reads the slots whose fences have passed, in the order they were issued
+void Fluid::CollectHealthMetrics(bool waitForOldest) {
+    while (_healthCollected < _healthIssued) {
+        const unsigned int slot = _healthCollected % HEALTH_METRICS_LATENCY;
+        if (!FencePassed(_healthFences[slot], waitForOldest)) break;
+        waitForOldest = false;
+
+        HealthReduction result = _healthSlots[slot].download(0, 1)[0];
+        _latestHealth.step = _healthSteps[slot];
+        _latestHealth.meanDensityError = result.values.x;
+        _latestHealth.maxDensityError = result.values.y;
+        _latestHealth.kineticEnergy = result.values.z;
+        _latestHealth.maxSpeed = result.values.w;
+        _latestHealth.boundaryParticles = result.boundaryParticles;
+        ++_healthCollected;
+
+        if (_healthLog) {
+            *_healthLog << _latestHealth.step << "," << _latestHealth.meanDensityError << "," << _latestHealth.maxDensityError << ","
+                        << _latestHealth.kineticEnergy << "," << _latestHealth.maxSpeed << "," << _latestHealth.boundaryParticles << "\n";
+        }
+    }
+}
+
+// Turning it off waits for the slots in flight so their rows are logged
+void Fluid::SetHealthMonitoring(bool enabled) {
+    _healthMonitoring = enabled;
+    if (enabled) return;
+    while (_healthCollected < _healthIssued) CollectHealthMetrics(true);
+}
+
+bool Fluid::GetHealthMetrics(HealthMetrics& metrics) {
+    CollectHealthMetrics(false);
+    if (_healthCollected == 0) return false;
+    metrics = _latestHealth;
+    return true;
+}
+
+void Fluid::SetHealthLog(std::ostream* log) {
+    _healthLog = log;
+    if (_healthLog) *_healthLog << "step,mean_density_error,max_density_error,kinetic_energy,max_speed,boundary_particles\n";
+}
+
+namespace {
+    const char CHECKPOINT_MAGIC[4] = { 'F', 'S', 'C', 'P' };
+    const uint32_t CHECKPOINT_VERSION = 1;
+
+    // Followed by the SimulationParameters, a uint64_t byte size per state
+    // buffer and the buffer contents back to back, all in native byte order
+    struct CheckpointHeader {
+        char magic[4];
+        uint32_t version;
+        uint32_t parametersSize;
+        uint32_t bufferCount;
+        uint32_t stateIndex;
+        uint32_t stepCount;
+        uint32_t spatialLookupValid;
+        uint32_t reserved;
+    };
+}
+
+// The incremental sort scratch buffers are refilled every step and left out.
+// Changing this list changes the file layout, bump CHECKPOINT_VERSION with it.
+template<typename Visit>
+void Fluid::ForEachStateBuffer(Visit visit) {
+    visit(_positions[0]);
+    visit(_positions[1]);
+    visit(_predictedPositions);
+    visit(_velocities[0]);
+    visit(_velocities[1]);
+    visit(_densities);
+    visit(_nearDensities);
+    visit(_spatialLookup);
+    visit(_cellRanges);
+    visit(_blockTable);
+    visit(_blockSlots);
+    visit(_blockCount);
+    visit(_neighborOffsets);
+    visit(_quantizedPositions);
+    visit(_halfVelocities[0]);
+    visit(_halfVelocities[1]);
+}
+
+// Call between steps, the copy is ordered after the last step's writes
+bool Fluid::SaveCheckpoint(const std::string& path) {
+    TRACE_ZONE("Fluid::SaveCheckpoint");
+    if (CheckpointPending()) return false;
+
+    // Offsets first, they may lay the arena out again
+    std::vector<GLintptr> offsets;
+    std::vector<uint64_t> sizes;
+    ForEachStateBuffer([&](auto& buffer) {
+        offsets.push_back(buffer.getOffset());
+        sizes.push_back(buffer.count() * buffer.elementSize());
+    });
+    const uint64_t total = std::accumulate(sizes.begin(), sizes.end(), uint64_t(0));
+
+    CheckpointHeader header = {};
+    std::memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.parametersSize = sizeof(SimulationParameters);
+    header.bufferCount = static_cast<uint32_t>(sizes.size());
+    header.stateIndex = _stateIndex;
+    header.stepCount = _stepCount;
+    header.spatialLookupValid = _spatialLookupValid ? 1u : 0u;
+
+    _checkpointHeader.resize(sizeof(header) + sizeof(SimulationParameters) + sizes.size() * sizeof(uint64_t));
+    unsigned char* out = _checkpointHeader.data();
+    std::memcpy(out, &header, sizeof(header));
+    std::memcpy(out + sizeof(header), &_params, sizeof(SimulationParameters));
+    std::memcpy(out + sizeof(header) + sizeof(SimulationParameters), sizes.data(), sizes.size() * sizeof(uint64_t));
+
+    // Packed back to back, so the file does not depend on the device's offset alignment
+    _checkpointStaging.resize(static_cast<size_t>(total), GL_STREAM_READ);
+    glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+    glBindBuffer(GL_COPY_READ_BUFFER, _arena.getID());
+    glBindBuffer(GL_COPY_WRITE_BUFFER, _checkpointStaging.getID());
+    GLintptr staged = 0;
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        if (sizes[i] > 0) glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, offsets[i], staged, static_cast<GLsizeiptr>(sizes[i]));
+        staged += static_cast<GLintptr>(sizes[i]);
+    }
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    _checkpointFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    _checkpointPath = path;
+    return true;
+}
+
+// Reads the staging buffer back once its copy has finished and hands the file
+// to a worker thread
+void Fluid::CollectCheckpoint(bool wait) {
+    if (!_checkpointFence || !FencePassed(_checkpointFence, wait)) return;
+
+    TRACE_ZONE("Fluid::CollectCheckpoint");
+    std::vector<unsigned char> contents = _checkpointStaging.download(0, _checkpointStaging.count());
+    _checkpointStaging.resize(1, GL_STREAM_READ);
+
+    _checkpointWrite = std::async(std::launch::async,
+        [path = _checkpointPath, header = std::move(_checkpointHeader), contents = std::move(contents)]() {
+            std::ofstream file(path, std::ios::binary | std::ios::trunc);
+            file.write(reinterpret_cast<const char*>(header.data()), header.size());
+            file.write(reinterpret_cast<const char*>(contents.data()), contents.size());
+            if (!file) {
+                std::cerr << "Could not write " << path << "\n";
+                return false;
+            }
+            return true;
+        });
+    _checkpointHeader.clear();
+}
+
+bool Fluid::CheckpointPending() {
+    CollectCheckpoint(false);
+    return _checkpointFence || (_checkpointWrite.valid() && _checkpointWrite.wait_for(std::chrono::seconds(0)) != std::future_status::ready);
+}
+
+bool Fluid::FinishCheckpoint() {
+    CollectCheckpoint(true);
+    return _checkpointWrite.valid() ? _checkpointWrite.get() : true;
+}
+
+bool Fluid::RestoreCheckpoint(const std::string& path) {
+    TRACE_ZONE("Fluid::RestoreCheckpoint");
+    MappedFile file(path);
+    if (!file.isOpen()) {
+        std::cerr << "Could not read " << path << "\n";
+        return false;
+    }
+
+    CheckpointHeader header = {};
+    if (file.size() >= sizeof(header)) std::memcpy(&header, file.data(), sizeof(header));
+    if (std::memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0 || header.version != CHECKPOINT_VERSION ||
+        header.parametersSize != sizeof(SimulationParameters)) {
+        std::cerr << path << " is not a checkpoint of version " << CHECKPOINT_VERSION << "\n";
+        return false;
+    }
+
+    unsigned int bufferCount = 0;
+    ForEachStateBuffer([&](auto&) { ++bufferCount; });
+    const size_t tableEnd = sizeof(header) + sizeof(SimulationParameters) + size_t(header.bufferCount) * sizeof(uint64_t);
+    if (header.bufferCount != bufferCount || file.size() < tableEnd) {
+        std::cerr << path << " is truncated\n";
+        return false;
+    }
+
+    SimulationParameters params;
+    std::memcpy(&params, file.data() + sizeof(header), sizeof(params));
+    if (params.particleCount != _params.particleCount) {
+        std::cerr << path << " holds " << params.particleCount << " particles, not " << _params.particleCount << "\n";
+        return false;
+    }
+
+    std::vector<uint64_t> sizes(bufferCount);
+    std::memcpy(sizes.data(), file.data() + sizeof(header) + sizeof(SimulationParameters), bufferCount * sizeof(uint64_t));
+    uint64_t total = tableEnd;
+    bool wholeElements = true;
+    size_t index = 0;
+    ForEachStateBuffer([&](auto& buffer) {
+        wholeElements = wholeElements && sizes[index] % buffer.elementSize() == 0;
+        total += sizes[index++];
+    });
+    if (!wholeElements || total != file.size()) {
+        std::cerr << path << " is truncated\n";
+        return false;
+    }
+
+    // Resize everything before taking offsets, the arena is laid out once
+    index = 0;
+    ForEachStateBuffer([&](auto& buffer) {
+        buffer.resize(static_cast<size_t>(sizes[index] / buffer.elementSize()));
+        ++index;
+    });
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, _arena.getID());
+    const unsigned char* contents = file.data() + tableEnd;
+    index = 0;
+    ForEachStateBuffer([&](auto& buffer) {
+        if (sizes[index] > 0) glBufferSubData(GL_SHADER_STORAGE_BUFFER, buffer.getOffset(), static_cast<GLsizeiptr>(sizes[index]), contents);
+        contents += sizes[index++];
+    });
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    params.isPaused = _params.isPaused;
+    params.isInteracting = _params.isInteracting;
+    _params = params;
+    _stateIndex = header.stateIndex & 1u;
+    _stepCount = header.stepCount;
+    _spatialLookupValid = header.spatialLookupValid != 0;
+
+    // Block counts in flight are of the table before the restore
+    if (_blockCountFence) glDeleteSync(_blockCountFence);
+    _blockCountFence = nullptr;
+    _lastBlockCount = _params.blockCapacity;
+    return true;
+}
+
+// Copies the stored attributes of the state just written into the next slot,
+// read back once its fence has passed like the health metrics
+void Fluid::CaptureCacheFrame(unsigned int state) {
+    if (_cacheIssued - _cacheCollected == PARTICLE_CACHE_LATENCY) CollectCacheFrames(true);
+    const unsigned int slot = _cacheIssued % PARTICLE_CACHE_LATENCY;
+    const GLsizeiptr bytes = GLsizeiptr(_params.particleCount) * sizeof(glm::vec4);
+
+    std::vector<GLintptr> sources;
+    if (_particleCache->attributes() & PARTICLE_CACHE_POSITIONS) sources.push_back(_positions[state].getOffset());
+    if (_particleCache->attributes() & PARTICLE_CACHE_VELOCITIES) sources.push_back(_velocities[state].getOffset());
+    const size_t count = std::max<size_t>(sources.size() * _params.particleCount, 1);
+    if (_cacheSlots[slot].count() != count) _cacheSlots[slot].resize(count, GL_STREAM_READ);
+
+    glBindBuffer(GL_COPY_READ_BUFFER, _arena.getID());
+    glBindBuffer(GL_COPY_WRITE_BUFFER, _cacheSlots[slot].getID());
+    for (size_t i = 0; i < sources.size(); ++i) {
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, sources[i], GLintptr(i) * bytes, bytes);
+    }
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    _cacheFences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    _cacheSteps[slot] = _stepCount + 1;
+    ++_cacheIssued;
+}
+
+// Hands the slots whose fences have passed to the cache's writer thread, in
+// the order they were issued
+void Fluid::CollectCacheFrames(bool waitForOldest) {
+    while (_cacheCollected < _cacheIssued) {
+        const unsigned int slot = _cacheCollected % PARTICLE_CACHE_LATENCY;
+        if (!FencePassed(_cacheFences[slot], waitForOldest)) break;
+        waitForOldest = false;
+
+        const GLuint N = _params.particleCount;
+        const uint32_t attributes = _particleCache->attributes();
+        size_t first = 0;
+        std::vector<glm::vec4> positions, velocities;
+        if (attributes & PARTICLE_CACHE_POSITIONS) {
+            positions = _cacheSlots[slot].download(first, N);
+            first += N;
+        }
+        if (attributes & PARTICLE_CACHE_VELOCITIES) velocities = _cacheSlots[slot].download(first, N);
+        _particleCache->append(_cacheSteps[slot], std::move(positions), std::move(velocities));
+        ++_cacheCollected;
+    }
+}
+
+void Fluid::SetParticleCache(ParticleCacheWriter* cache, unsigned int interval) {
+    while (_cacheCollected < _cacheIssued) CollectCacheFrames(true);
+    _particleCache = (cache && cache->particleCount() == _params.particleCount) ? cache : nullptr;
+    _cacheInterval = std::max(interval, 1u);
+    if (cache && !_particleCache) std::cerr << "Particle cache holds " << cache->particleCount() << " particles, not " << _params.particleCount << "\n";
+    if (!_particleCache) {
+        for (SSBO<glm::vec4>& slot : _cacheSlots) slot.resize(1, GL_STREAM_READ);
+    }
+}
+
+bool Fluid::ShadersReady() {
+    for (const ComputeShader* shader : { &_predictedPosShader, &_updateSpatialLookup, &_densityStep, &_forceStep,
+                                         &_bitonicSortShader, &_buildCellRanges, &_refreshSpatialKeys, &_prefixSum,
+                                         &_scatterChangedEntries, &_mergeSpatialLookup, &_allocateGridBlocks, &_quantizePositions, &_neighborStats,
+                                         &_healthMetrics }) {
+        if (!shader->isReady()) return false;
+    }
+    return true;
+}
+
+static std::string FloatLiteral(float value) {
+    char text[32];
+    std::snprintf(text, sizeof(text), "float(%.9g)", value);
+    return text;
+}
+
+void Fluid::RefreshSpecialization() {
+    const float h = _params.smoothingRadius;
+    const float pi = 3.14159265359f;
+    _params.spikyPow2Scale = 15.0f / (2.0f * pi * std::pow(h, 5.0f));
+    _params.spikyPow3Scale = 15.0f / (pi * std::pow(h, 6.0f));
+    _params.spikyPow2DerivativeScale = 15.0f / (pi * std::pow(h, 5.0f));
+    _params.spikyPow3DerivativeScale = 45.0f / (pi * std::pow(h, 6.0f));
+    _params.poly6Scale = 315.0f / (64.0f * pi * std::pow(std::abs(h), 9.0f));
+
+    ShaderDefines defines;
+    if (_specializeShaders) {
+        defines = {
+            { "SPECIALIZED", "1" },
+            { "SMOOTHING_RADIUS", FloatLiteral(h) },
+            { "MASS", FloatLiteral(_params.mass) },
+            { "HASH_SIZE", std::to_string(_params.hashSize) + "u" },
+            { "HASH_MIXING", std::to_string(_params.hashMixing) + "u" },
+            { "CELL_SIZE", FloatLiteral(_params.cellSize) },
+            { "MAX_NEIGHBOR_CELLS", std::to_string(_params.neighborOffsetCount) + "u" },
+            { "SPIKY_POW2_SCALE", FloatLiteral(_params.spikyPow2Scale) },
+            { "SPIKY_POW3_SCALE", FloatLiteral(_params.spikyPow3Scale) },
+            { "SPIKY_POW2_DERIVATIVE_SCALE", FloatLiteral(_params.spikyPow2DerivativeScale) },
+            { "SPIKY_POW3_DERIVATIVE_SCALE", FloatLiteral(_params.spikyPow3DerivativeScale) },
+            { "POLY6_SCALE", FloatLiteral(_params.poly6Scale) },
+        };
+    }
+    for (ComputeShader* shader : { &_predictedPosShader, &_updateSpatialLookup, &_refreshSpatialKeys,
+                                   &_allocateGridBlocks, &_quantizePositions, &_densityStep, &_forceStep }) {
+        shader->specialize(defines);
+    }
+}
+
+void Fluid::SetHashSize(unsigned int hashSize, bool mixed) {
+    _params.hashSize = std::max(1u, hashSize);
+    _params.hashMixing = mixed;
+    if (_params.gridMode == GRID_HASHED) _cellRanges.resize(_params.hashSize);
+    _spatialLookupValid = false;
+}
+
+unsigned int Fluid::GetHashSize() { return _params.hashSize; }
+
+static unsigned int NextPrime(unsigned int n) {
+    auto isPrime = [](unsigned int value) {
+        if (value < 2) return false;
+        for (unsigned int d = 2; d * d <= value; ++d) {
+            if (value % d == 0) return false;
+        }
+        return true;
+    };
+    while (!isPrime(n)) ++n;
+    return n;
+}
+
+// Keys, sort and cell ranges of the current predicted positions outside of the
+// frame graph, so a grid configuration can be measured without taking a step
+void Fluid::RebuildSpatialLookup() {
+    const GLuint N = _params.particleCount;
+    RefreshSpecialization();
+    _simParams.upload(std::vector<SimulationParameters>{_params});
+
+    _updateSpatialLookup.use();
+    _predictedPositions.bindTo(2);
+    _spatialLookup.bindTo(6);
+    _simParams.bindTo(8);
+    _blockTable.bindTo(13);
+    _blockSlots.bindTo(14);
+    _updateSpatialLookup.dispatchFor(N);
+    _updateSpatialLookup.wait();
+
+    SortSpatialLookup();
+
+    _cellRanges.clear();
+    glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+    _buildCellRanges.use();
+    _spatialLookup.bindTo(6);
+    _cellRanges.bindTo(7);
+    _simParams.bindTo(8);
+    _buildCellRanges.dispatchFor(N);
+    _buildCellRanges.wait();
+}
+
+HashSizeChoice Fluid::MeasureHashSize(unsigned int hashSize, bool mixed) {
+    SetHashSize(hashSize, mixed);
+    RebuildSpatialLookup();
+    NeighborStatistics stats = MeasureNeighborStatistics();
+    return HashSizeChoice{ hashSize, mixed, stats.collidedBucketRate, stats.meanCandidates };
+}
+
+// Candidates come in pairs of about the same memory, a power of two and the
+// prime above it, and the pair's better one is kept once either meets the
+// target. Cost is the candidates per particle, which counts the entries of
+// other cells the neighbor loops have to skip.
+HashSizeChoice Fluid::TuneHashSize(float targetCollisionRate, size_t memoryBudget) {
+    _hashTargetCollisionRate = targetCollisionRate;
+    _hashMemoryBudget = memoryBudget;
+    _hashTunedStep = _stepCount;
+
+    HashSizeChoice current{ _params.hashSize, _params.hashMixing != 0, 0.0f, 0.0f };
+    if (_params.gridMode != GRID_HASHED) return current;
+
+    const size_t maxSize = std::min<size_t>(memoryBudget / sizeof(CellRange), 1u << 31);
+    // Fewer buckets than an eighth of the particles collide whatever the hash
+    size_t size = 1024;
+    while (size < _params.particleCount / 8) size <<= 1;
+    if (size > maxSize) return current;
+
+    HashSizeChoice best{ 0, false, 0.0f, 0.0f };
+    for (; size <= maxSize; size <<= 1) {
+        HashSizeChoice pair[2] = { MeasureHashSize(unsigned(size), true), {} };
+        unsigned int prime = NextPrime(unsigned(size) + 1);
+        const int count = (prime <= maxSize) ? 2 : 1;
+        if (count == 2) pair[1] = MeasureHashSize(prime, false);
+
+        bool reached = false;
+        for (int i = 0; i < count; ++i) {
+            const HashSizeChoice& choice = pair[i];
+            bool meets = choice.collidedBucketRate <= targetCollisionRate;
+            if (meets) {
+                if (!reached || choice.meanCandidates < best.meanCandidates) best = choice;
+                reached = true;
+            }
+            else if (!reached && (best.hashSize == 0 || choice.collidedBucketRate < best.collidedBucketRate)) {
+                best = choice;
+            }
+        }
+        if (reached) break;
+    }
+
+    SetHashSize(best.hashSize, best.mixed);
+    return best;
+}
+
+void Fluid::SetHashRetuneInterval(unsigned int steps) { _hashRetuneInterval = steps; }
+
+void Fluid::SetGridMode(GridMode mode) {
+    _params.gridMode = mode;
+    if (mode == GRID_SPARSE) {
+        ResizeGridBlocks(std::max(64u, (_params.particleCount + GRID_BLOCK_CELLS - 1) / GRID_BLOCK_CELLS));
+    }
+    else {
+        _cellRanges.resize(_params.hashSize);
+    }
+    _spatialLookupValid = false;
+}
+
 
 
 
@@ -5,19 +5,28 @@
 #define GLM_ENABLE_EXPERIMENTAL 
 
 #include "ComputeShader.h"
+#include "FrameGraph.h"
 #include "SSBO.hpp"
+#include "SSBOArena.hpp"
 
 #include <glm/glm.hpp>  
 #include <glm/gtx/string_cast.hpp>  
+#include <future>
+#include <ostream>
+#include <string>
 #include <vector>   
 #include <limits>  
 #include <numeric>
 
+class ParticleCacheWriter;
+class WorkGroupTuner;
+
 const float PI = 3.14159265359f;
 const float EPSILON = std::numeric_limits<float>::epsilon();
 const unsigned int MAX_INT = std::numeric_limits<unsigned int>::max();
 
 
+// Declared once for all shaders in fluid_common.glsl, keep the two in sync
 struct SimulationParameters {
 	float dt;
 	float gravityAcceleration;
@@ -43,41 +52,262 @@ struct SimulationParameters {
 	float boundaryX;
 	float boundaryY;
 	float boundaryZ;
+
+	uint32_t gridMode;
+	uint32_t blockTableSize;
+	uint32_t blockCapacity;
+
+	float cellSize;
+	uint32_t cellSizeFactor;
+	uint32_t neighborOffsetCount;
+
+	uint32_t packedDensities;
+	uint32_t quantizePositions;
+	uint32_t useHalfVelocities;
+
+	// Kernel normalization factors, derived from smoothingRadius
+	float spikyPow2Scale;
+	float spikyPow3Scale;
+	float spikyPow2DerivativeScale;
+	float spikyPow3DerivativeScale;
+	float poly6Scale;
+
+	uint32_t hashMixing;
 };
 
+// Neighbor search grid, see fluid_common.glsl for the sparse layout
+enum GridMode : uint32_t {
+	GRID_HASHED = 0, // hashSize buckets, cells may collide
+	GRID_SPARSE = 1  // 4x4x4 cell blocks allocated on demand, one key per cell
+};
+
+const unsigned int GRID_BLOCK_CELLS = 64;
+
+// Quantized positions tag each particle with its 16-bit cell index in the
+// domain grid, one value is reserved for cells outside it
+const unsigned int QUANTIZED_MAX_DOMAIN_CELLS = 0xFFFF;
+
 struct Entry {
 	int index;
 	unsigned int key;
 };
 
+// [start, end) of a key's run in the sorted spatial lookup, empty when start == end
+struct CellRange {
+	unsigned int start;
+	unsigned int end;
+};
+
+// Error of the 16-bit quantized positions against full float, densities as relative error
+struct QuantizationError {
+	float maxPositionError;
+	float rmsPositionError;
+	float maxDensityError;
+	float rmsDensityError;
+};
+
+// Histograms of the neighbor search, bin i counts the particles (buckets for
+// bucketLoad) with i of something, the last bin everything above. Counts are
+// taken on the sorted lookup and predicted positions of the last step.
+const unsigned int NEIGHBOR_STAT_BINS = 256;
+
+struct NeighborStatistics {
+	std::vector<unsigned int> candidates;    // entries inspected in the visited buckets
+	std::vector<unsigned int> neighbors;     // candidates within the radius
+	std::vector<unsigned int> occupiedCells; // visited cells holding particles
+	std::vector<unsigned int> bucketLoad;    // particles per occupied bucket
+	float meanCandidates;
+	float meanNeighbors;
+	float meanOccupiedCells;
+	float meanBucketLoad;
+	float foreignCandidateRate; // candidates from a cell the search does not visit, hashed to a visited bucket
+	float collidedBucketRate;   // occupied buckets holding more than one cell
+	unsigned int occupiedBuckets;
+	unsigned int mergedCells;   // cells sharing a bucket with another cell
+};
+
+// Summary of one step's state, see Fluid::SetHealthMonitoring. Density errors
+// are relative to the target density.
+struct HealthMetrics {
+	unsigned int step;              // steps taken before this one was measured
+	float meanDensityError;
+	float maxDensityError;
+	float kineticEnergy;
+	float maxSpeed;
+	unsigned int boundaryParticles; // clamped onto a wall this step
+};
+
+// Workgroup partial or finished slot of health_metrics.comp, std430 pads it to 32 bytes
+struct HealthReduction {
+	glm::vec4 values;
+	uint32_t boundaryParticles;
+	uint32_t padding[3];
+};
+
+// Slots in flight, results come back this many steps late at most
+const unsigned int HEALTH_METRICS_LATENCY = 3;
+
+// Particle cache frames in flight, see Fluid::SetParticleCache
+const unsigned int PARTICLE_CACHE_LATENCY = 3;
+
+// A hashed grid size measured by Fluid::TuneHashSize
+struct HashSizeChoice {
+	unsigned int hashSize;
+	bool mixed;               // cells hashed with MixHash instead of the XOR of primes
+	float collidedBucketRate; // occupied buckets holding more than one cell
+	float meanCandidates;     // entries the neighbor loops inspect per particle
+};
+
 class Fluid {  
 	private :  
-		SSBO <glm::vec4> _positions;
-		SSBO <glm::vec4> _predictedPositions;
-		SSBO <glm::vec4> _velocities; 
-		SSBO <float> _densities;  
-		SSBO <float> _nearDensities;
-		SSBO <Entry> _spatialLookup;
-		SSBO <unsigned int> _startIndices;
+		// Particle and grid arrays share one buffer, declared before the views
+		SSBOArena _arena;
+
+		// Particle state is double buffered, passes read _stateIndex and the
+		// force pass writes the other copy
+		ArenaBuffer <glm::vec4> _positions[2];
+		ArenaBuffer <glm::vec4> _predictedPositions;
+		ArenaBuffer <glm::vec4> _velocities[2];
+		ArenaBuffer <float> _densities;  
+		ArenaBuffer <float> _nearDensities;
+		ArenaBuffer <Entry> _spatialLookup;
+		ArenaBuffer <CellRange> _cellRanges;
 		SSBO <SimulationParameters> _simParams;
 
+		// Incremental re-sort scratch buffers
+		ArenaBuffer <unsigned int> _changedFlags;
+		ArenaBuffer <unsigned int> _scanBlockSums;
+		ArenaBuffer <Entry> _changedLookup;
+		ArenaBuffer <Entry> _stableLookup;
+		ArenaBuffer <unsigned int> _sortDispatch; // workgroups of the changed entries' sort
+
+		// Changed entries of an earlier step, read back behind a fence to
+		// choose between the incremental and the full sort
+		SSBO <unsigned int> _changedCountReadback;
+
+		// Sparse grid block table
+		ArenaBuffer <unsigned int> _blockTable;
+		ArenaBuffer <unsigned int> _blockSlots;
+		ArenaBuffer <unsigned int> _blockCount;
+		SSBO <unsigned int> _blockCountReadback; // blocks in use some steps ago
+
+		ArenaBuffer <glm::ivec4> _neighborOffsets;
+		ArenaBuffer <glm::uvec2> _quantizedPositions;
+		ArenaBuffer <glm::uvec2> _halfVelocities[2];
+
+		// Histograms and counters of MeasureNeighborStatistics
+		SSBO <unsigned int> _neighborStatsBuffer;
+
+		// Health metrics partials and the ring of results read back behind
+		// fences, one buffer per slot so reading one never waits on the others
+		SSBO <HealthReduction> _healthPartials;
+		SSBO <HealthReduction> _healthSlots[HEALTH_METRICS_LATENCY];
+
+		// Checkpoint in flight: the state ranges are copied here on the GPU,
+		// read back once the fence has passed and written on a worker thread
+		SSBO <unsigned char> _checkpointStaging;
+
+		// Particle cache frames being read back, the stored attributes of one
+		// step back to back in each
+		SSBO <glm::vec4> _cacheSlots[PARTICLE_CACHE_LATENCY];
+
 		ComputeShader _predictedPosShader;
 		ComputeShader _updateSpatialLookup;
 		ComputeShader _densityStep;
 		ComputeShader _forceStep;
-		ComputeShader _fluidStep;
 		ComputeShader _bitonicSortShader;
-		ComputeShader _buildStartIndices;
+		ComputeShader _buildCellRanges;
+		ComputeShader _refreshSpatialKeys;
+		ComputeShader _prefixSum;
+		ComputeShader _scatterChangedEntries;
+		ComputeShader _mergeSpatialLookup;
+		ComputeShader _allocateGridBlocks;
+		ComputeShader _quantizePositions;
+		ComputeShader _neighborStats;
+		ComputeShader _healthMetrics;
 
 		SimulationParameters _params;
+		FrameGraph _frameGraph;
+
+		bool _incrementalSort;
+		float _resortThreshold;
+		GLsync _changedCountFence;
+		unsigned int _lastChangedCount;
+		GLsync _blockCountFence;
+		unsigned int _lastBlockCount;
+		bool _spatialLookupValid;
+		unsigned int _stateIndex;
+		bool _specializeShaders;
+		unsigned int _stepCount;
+
+		float _hashTargetCollisionRate;
+		size_t _hashMemoryBudget;
+		unsigned int _hashRetuneInterval;
+		unsigned int _hashTunedStep;
+
+		bool _healthMonitoring;
+		GLsync _healthFences[HEALTH_METRICS_LATENCY];
+		unsigned int _healthSteps[HEALTH_METRICS_LATENCY];
+		unsigned int _healthIssued;
+		unsigned int _healthCollected;
+		HealthMetrics _latestHealth;
+		std::ostream* _healthLog;
+
+		GLsync _checkpointFence;
+		std::string _checkpointPath;
+		std::vector<unsigned char> _checkpointHeader; // everything before the buffer contents
+		std::future<bool> _checkpointWrite;
+
+		ParticleCacheWriter* _particleCache;
+		unsigned int _cacheInterval;
+		GLsync _cacheFences[PARTICLE_CACHE_LATENCY];
+		unsigned int _cacheSteps[PARTICLE_CACHE_LATENCY];
+		unsigned int _cacheIssued;
+		unsigned int _cacheCollected;
+
+		// groups: workgroup counts for every stage written on the GPU, null to
+		// cover all of count
+		void SortEntries(ArenaBuffer<Entry>& entries, GLuint count, const ArenaBuffer<unsigned int>* groups = nullptr);
+		GLuint PrefixSum(ArenaBuffer<unsigned int>& data, GLuint count);
+		void ReadCounterLate(const ArenaBuffer<unsigned int>& counter, size_t index, SSBO<unsigned int>& readback, GLsync& fence, unsigned int& value);
+		void AllocateGridBlocks();
+		void ResizeGridBlocks(GLuint capacity);
+		void ResetGridBlocks();
+		void CalculateDensities();
+		std::vector<float> ReadDensities();
+		void RefreshSpecialization();
+		void RebuildSpatialLookup();
+		HashSizeChoice MeasureHashSize(unsigned int hashSize, bool mixed);
+		void MeasureHealth();
+		void CollectHealthMetrics(bool waitForOldest);
+		// Calls visit on each arena view holding simulation state, in file order
+		template<typename Visit> void ForEachStateBuffer(Visit visit);
+		void CollectCheckpoint(bool wait);
+		void CaptureCacheFrame(unsigned int state);
+		void CollectCacheFrames(bool waitForOldest);
 
 	public:  
 		Fluid(unsigned int particleCount, float particleRadius, const float mass, const float gravity, const float collisionDamping, const float spacing, const float pressureMultiplier, const float targetDensity, const float smoothingRadius, const unsigned int hashSize, const float interactionRadius, const float interactionStrength, float viscosityStrength, float nearDensityMultiplier, float boundaryX, float boundaryY, float boundaryZ);
 
+		// Finishes writing a pending checkpoint, drops the health metrics and
+		// cache frames still being read back
+		~Fluid();
+
+		// Smallest particle count at least count that the spatial lookup sort
+		// takes, a power of two. Zero when none fits in 32 bits.
+		static unsigned int SortableParticleCount(unsigned int count);
+
 		void Update(float dt);
 
+		// Runs only the pass of Update with this frame graph name, on the
+		// current state and without advancing it. False when Update has no
+		// such pass in the current configuration. For benchmarks.
+		bool UpdatePass(const char* name, float dt);
+
 		void SortSpatialLookup();
 
+		void IncrementalSortSpatialLookup();
+
 		void BindRenderBuffers();
 
 		// Setter/getter methods for keyboard controls
@@ -96,6 +326,72 @@ class Fluid {
 		void SetViscosityStrength(float strength);
 		float GetNearDensityMultiplier();
 		void SetNearDensityMultiplier(float nearDensityMultiplier);
+		void SetIncrementalSort(bool enabled);
+		void SetResortThreshold(float fraction);
+		void SetGridMode(GridMode mode);
+		// Resizes the cell ranges of the hashed grid in place, the lookup is
+		// rebuilt on the next step
+		void SetHashSize(unsigned int hashSize, bool mixed);
+		unsigned int GetHashSize();
+		// Measures powers of two with mixed keys and primes with plain keys
+		// whose cell ranges fit in memoryBudget bytes, from small to large, and
+		// keeps the first size with at most targetCollisionRate of the
+		// occupied buckets shared by several cells. Without one it keeps the
+		// lowest rate measured. Rebuilds the lookup for every candidate from
+		// the last predicted positions and waits for the GPU. Hashed grid only.
+		HashSizeChoice TuneHashSize(float targetCollisionRate, size_t memoryBudget);
+		// Repeats the last TuneHashSize every this many steps, 0 never
+		void SetHashRetuneInterval(unsigned int steps);
+		// Turns quantized positions off when the smaller cells outgrow their tags
+		void SetCellSizeFactor(unsigned int cellsPerRadius);
+		unsigned int GetCellSizeFactor();
+		unsigned int GetNeighborCellCount();
+		void SetPackedDensities(bool packed);
+		// False when the domain grid has more than QUANTIZED_MAX_DOMAIN_CELLS
+		// cells at the current cell size, positions then stay float
+		bool SetQuantizedPositions(bool quantized);
+		// Cells of the grid over the boundaries at the current cell size
+		uint64_t GetDomainCellCount();
+		QuantizationError MeasureQuantizationError();
+		NeighborStatistics MeasureNeighborStatistics();
+		void SetHalfVelocities(bool enabled);
+		bool GetHalfVelocities();
+		void SetSpecializedShaders(bool enabled);
+		// True once every compute program has compiled and linked, never blocks
+		bool ShadersReady();
+		// Times each pass of Update as a stage, null to stop
+		void SetProfiler(GpuProfiler* profiler);
+		// Sets every per-particle kernel to its fastest workgroup size for this
+		// particle count, from the tuner's cache or by timing the passes that
+		// run in the current configuration. Takes a step before each kernel
+		// it times.
+		void TuneWorkGroupSizes(WorkGroupTuner& tuner);
+		// Reduces density error, kinetic energy, max speed and boundary
+		// contacts on the GPU after every step, read back without stalling
+		void SetHealthMonitoring(bool enabled);
+		// Latest metrics that have come back, false before the first
+		bool GetHealthMetrics(HealthMetrics& metrics);
+		// Appends a CSV row per collected step, writes the header now. Null to stop.
+		void SetHealthLog(std::ostream* log);
+		// Writes the particle buffers and parameters to a versioned binary file
+		// without stalling the simulation: the buffers are copied on the GPU
+		// now, read back once the copy has finished and written on a worker
+		// thread. False while the previous checkpoint is still pending.
+		bool SaveCheckpoint(const std::string& path);
+		// True while a checkpoint is being read back or written
+		bool CheckpointPending();
+		// Waits for the pending checkpoint, false when writing it failed
+		bool FinishCheckpoint();
+		// Continues from a checkpoint with the same particle count, uploaded
+		// to the buffers straight from the mapped file. Grid, storage formats
+		// and parameters come from the file, the pause and interaction state
+		// stay. False with the state untouched when the file does not match.
+		bool RestoreCheckpoint(const std::string& path);
+		// Streams the positions and velocities the cache stores of every
+		// interval-th step to it, read back a few steps late without stalling.
+		// Null stops after handing over the frames in flight, do that before
+		// the cache is closed.
+		void SetParticleCache(ParticleCacheWriter* cache, unsigned int interval);
 };  
 
 #endif // FLUID_CLASS_H
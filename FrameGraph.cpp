@@ -0,0 +1,139 @@
+#include "FrameGraph.h"
+#include "GpuProfiler.h"
+#include "Trace.h"
+#include <algorithm>
+#include <cstring>
+
+namespace {
+	bool Touches(const std::vector<FrameGraph::Resource>& list, FrameGraph::Resource resource)
+	{
+		return std::find(list.begin(), list.end(), resource) != list.end();
+	}
+
+	GLbitfield BarrierBit(PassKind kind)
+	{
+		return (kind == PassKind::Transfer) ? GL_BUFFER_UPDATE_BARRIER_BIT : GL_SHADER_STORAGE_BARRIER_BIT;
+	}
+}
+
+FrameGraph::FrameGraph()
+	: _reordering(true), _barrierCount(0), _passesRun(0), _profiler(nullptr), _passFilter(nullptr)
+{
+}
+
+void FrameGraph::addPass(const char* name, PassKind kind, std::vector<Resource> reads, std::vector<Resource> writes, std::function<void()> run)
+{
+	_passes.push_back(Pass{ name, kind, std::move(reads), std::move(writes), std::move(run) });
+}
+
+// Each pass gets a level: after any pass whose shader writes it touches, and no
+// earlier than any pass it only has to stay ordered with (write after read,
+// or a transfer write, which GL orders itself). A stable sort by level keeps
+// every dependency and moves independent passes next to each other.
+std::vector<size_t> FrameGraph::schedule() const
+{
+	std::vector<size_t> order(_passes.size());
+	for (size_t i = 0; i < order.size(); ++i) order[i] = i;
+	if (!_reordering) return order;
+
+	std::vector<unsigned int> level(_passes.size(), 0);
+	for (size_t j = 0; j < _passes.size(); ++j) {
+		const Pass& later = _passes[j];
+		for (size_t i = 0; i < j; ++i) {
+			const Pass& earlier = _passes[i];
+			bool needsBarrier = false;
+			bool needsOrder = false;
+
+			for (Resource resource : earlier.writes) {
+				if (Touches(later.reads, resource) || Touches(later.writes, resource)) {
+					if (earlier.kind == PassKind::Compute) needsBarrier = true;
+					else needsOrder = true;
+				}
+			}
+			for (Resource resource : earlier.reads) {
+				if (Touches(later.writes, resource)) needsOrder = true;
+			}
+
+			if (needsBarrier) level[j] = std::max(level[j], level[i] + 1);
+			else if (needsOrder) level[j] = std::max(level[j], level[i]);
+		}
+	}
+
+	std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return level[a] < level[b]; });
+	return order;
+}
+
+void FrameGraph::barrierFor(PassKind kind, const std::vector<Resource>& reads, const std::vector<Resource>& writes)
+{
+	GLbitfield bit = BarrierBit(kind);
+	bool owed = false;
+	for (const std::vector<Resource>* list : { &reads, &writes }) {
+		for (Resource resource : *list) {
+			auto it = _pending.find(resource);
+			if (it != _pending.end() && (it->second & bit)) owed = true;
+		}
+	}
+	if (!owed) return;
+
+	// A barrier covers every earlier write, not just the ones this pass needs
+	glMemoryBarrier(bit);
+	++_barrierCount;
+	for (auto it = _pending.begin(); it != _pending.end();) {
+		it->second &= ~bit;
+		if (it->second == 0) it = _pending.erase(it);
+		else ++it;
+	}
+}
+
+void FrameGraph::execute()
+{
+	_barrierCount = 0;
+	_passesRun = 0;
+	for (size_t index : schedule()) {
+		Pass& pass = _passes[index];
+		if (_passFilter && std::strcmp(pass.name, _passFilter) != 0) continue;
+		++_passesRun;
+		TRACE_ZONE(pass.name);
+		barrierFor(pass.kind, pass.reads, pass.writes);
+		if (_profiler) _profiler->beginStage(pass.name);
+		pass.run();
+		if (_profiler) _profiler->endStage();
+
+		if (pass.kind == PassKind::Compute) {
+			for (Resource resource : pass.writes) {
+				_pending[resource] = GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT;
+			}
+		}
+	}
+	_passes.clear();
+}
+
+void FrameGraph::prepareDraw(const std::vector<Resource>& reads)
+{
+	barrierFor(PassKind::Draw, reads, {});
+}
+
+void FrameGraph::setReordering(bool enabled)
+{
+	_reordering = enabled;
+}
+
+void FrameGraph::setProfiler(GpuProfiler* profiler)
+{
+	_profiler = profiler;
+}
+
+void FrameGraph::setPassFilter(const char* name)
+{
+	_passFilter = name;
+}
+
+unsigned int FrameGraph::barrierCount() const
+{
+	return _barrierCount;
+}
+
+unsigned int FrameGraph::passesRun() const
+{
+	return _passesRun;
+}
@@ -0,0 +1,81 @@
+#ifndef FRAME_GRAPH_H
+#define FRAME_GRAPH_H
+
+#include<glad/glad.h>
+#include<functional>
+#include<unordered_map>
+#include<vector>
+
+class GpuProfiler;
+
+// How a pass touches its buffers, which decides the barrier bit it needs
+// before reading something a shader wrote
+enum class PassKind {
+	Compute,  // dispatches, shader storage reads and writes
+	Transfer, // clears, uploads and readbacks
+	Draw      // vertex shader reads the buffers as SSBOs
+};
+
+// Records the passes of a frame with the buffers they read and write, then runs
+// them with only the memory barriers their dependencies need. Passes that do
+// not depend on each other are grouped so they share a barrier.
+// Buffers are identified by address, any SSBO or ArenaBuffer works.
+class FrameGraph
+{
+public:
+		using Resource = const void*;
+
+		FrameGraph();
+
+		// Record a pass, nothing runs until execute()
+		void addPass(const char* name, PassKind kind, std::vector<Resource> reads, std::vector<Resource> writes, std::function<void()> run);
+
+		// Run and clear the recorded passes
+		void execute();
+
+		// Issue the barrier a draw reading these buffers needs
+		void prepareDraw(const std::vector<Resource>& reads);
+
+		// Keep passes in recorded order, for debugging
+		void setReordering(bool enabled);
+
+		// Time every pass as a stage named after it, null to stop
+		void setProfiler(GpuProfiler* profiler);
+
+		// Run only the passes with this name and drop the others, for
+		// benchmarking a pass on its own. Null runs everything.
+		void setPassFilter(const char* name);
+
+		// Barriers issued by the last execute()
+		unsigned int barrierCount() const;
+
+		// Passes run by the last execute()
+		unsigned int passesRun() const;
+
+private:
+		struct Pass {
+			const char* name;
+			PassKind kind;
+			std::vector<Resource> reads;
+			std::vector<Resource> writes;
+			std::function<void()> run;
+		};
+
+		std::vector<Pass> _passes;
+
+		// Barrier bits still owed to each buffer since a shader last wrote it,
+		// kept across frames so the next frame and the draw see them too
+		std::unordered_map<Resource, GLbitfield> _pending;
+
+		bool _reordering;
+		unsigned int _barrierCount;
+		unsigned int _passesRun;
+		GpuProfiler* _profiler;
+		const char* _passFilter;
+
+		std::vector<size_t> schedule() const;
+
+		void barrierFor(PassKind kind, const std::vector<Resource>& reads, const std::vector<Resource>& writes);
+};
+
+#endif
@@ -0,0 +1,148 @@
+#include "GpuProfiler.h"
+#include "Trace.h"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+
+GpuProfiler::GpuProfiler(unsigned int latency, size_t history)
+	: _frames(std::max(1u, latency), Frame{ {}, {}, false, 0.0 }), _frameIndex(0), _inFrame(false), _inStage(false), _history(std::max<size_t>(1, history)), _droppedFrames(0)
+{
+}
+
+GpuProfiler::~GpuProfiler()
+{
+	for (Frame& frame : _frames) {
+		if (!frame.queries.empty()) glDeleteQueries(GLsizei(frame.queries.size()), frame.queries.data());
+	}
+}
+
+void GpuProfiler::beginFrame()
+{
+	Frame& frame = _frames[_frameIndex];
+	collect(frame);
+	_inFrame = true;
+
+	// GL_TIMESTAMP read now is the GPU clock at this point of the command
+	// stream, pairing it with the CPU clock maps the frame's stages onto it
+	frame.traced = Trace::enabled();
+	if (frame.traced) {
+		GLint64 gpuNow = 0;
+		glGetInteger64v(GL_TIMESTAMP, &gpuNow);
+		frame.clockOffset = Trace::now() - gpuNow * 1e-3;
+	}
+}
+
+void GpuProfiler::endFrame()
+{
+	if (_inStage) endStage();
+	_inFrame = false;
+	_frameIndex = (_frameIndex + 1) % _frames.size();
+}
+
+void GpuProfiler::beginStage(const char* name)
+{
+	if (!_inFrame) return;
+	if (_inStage) endStage();
+
+	auto found = _stageIndices.find(name);
+	if (found == _stageIndices.end()) {
+		found = _stageIndices.emplace(name, _stageNames.size()).first;
+		_stageNames.push_back(name);
+		_samples.emplace_back();
+	}
+
+	Frame& frame = _frames[_frameIndex];
+	size_t first = frame.stages.size() * 2;
+	if (frame.queries.size() < first + 2) {
+		frame.queries.resize(first + 2);
+		glGenQueries(2, &frame.queries[first]);
+	}
+	frame.stages.push_back(found->second);
+	glQueryCounter(frame.queries[first], GL_TIMESTAMP);
+	_inStage = true;
+}
+
+void GpuProfiler::endStage()
+{
+	if (!_inStage) return;
+	Frame& frame = _frames[_frameIndex];
+	glQueryCounter(frame.queries[frame.stages.size() * 2 - 1], GL_TIMESTAMP);
+	_inStage = false;
+}
+
+// The frame was issued 'latency' frames ago so its results are normally
+// there. If not, its samples are dropped rather than stalling on them. The
+// queries complete in order, so the last one being there covers the rest.
+void GpuProfiler::collect(Frame& frame)
+{
+	if (frame.stages.empty()) return;
+	GLuint available = GL_FALSE;
+	glGetQueryObjectuiv(frame.queries[frame.stages.size() * 2 - 1], GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!available) {
+		++_droppedFrames;
+		frame.stages.clear();
+		return;
+	}
+
+	for (size_t i = 0; i < frame.stages.size(); ++i) {
+		GLuint64 begin = 0, end = 0;
+		glGetQueryObjectui64v(frame.queries[i * 2], GL_QUERY_RESULT, &begin);
+		glGetQueryObjectui64v(frame.queries[i * 2 + 1], GL_QUERY_RESULT, &end);
+
+		std::deque<double>& samples = _samples[frame.stages[i]];
+		samples.push_back((end - begin) * 1e-6);
+		if (samples.size() > _history) samples.pop_front();
+
+		if (frame.traced) {
+			Trace::gpuZone(_stageNames[frame.stages[i]], begin * 1e-3 + frame.clockOffset, end * 1e-3 + frame.clockOffset);
+		}
+	}
+	frame.stages.clear();
+}
+
+std::vector<GpuProfiler::StageStatistics> GpuProfiler::statistics() const
+{
+	std::vector<StageStatistics> result;
+	for (size_t i = 0; i < _stageNames.size(); ++i) {
+		std::vector<double> sorted(_samples[i].begin(), _samples[i].end());
+		if (sorted.empty()) continue;
+		std::sort(sorted.begin(), sorted.end());
+
+		double sum = 0.0;
+		for (double sample : sorted) sum += sample;
+		size_t p95 = size_t(std::ceil(0.95 * sorted.size())) - 1;
+		result.push_back(StageStatistics{ _stageNames[i], sorted.size(), sorted.front(), sum / sorted.size(), sorted[p95] });
+	}
+	return result;
+}
+
+void GpuProfiler::print(std::ostream& out) const
+{
+	out << std::left << std::setw(24) << "stage" << std::right
+		<< std::setw(10) << "samples" << std::setw(10) << "min ms" << std::setw(10) << "mean ms" << std::setw(10) << "p95 ms" << "\n";
+	for (const StageStatistics& stage : statistics()) {
+		out << std::left << std::setw(24) << stage.name << std::right << std::setw(10) << stage.samples
+			<< std::fixed << std::setprecision(3)
+			<< std::setw(10) << stage.minMs << std::setw(10) << stage.meanMs << std::setw(10) << stage.p95Ms << "\n"
+			<< std::defaultfloat;
+	}
+	if (_droppedFrames) out << _droppedFrames << " frames dropped, their results were late\n";
+}
+
+size_t GpuProfiler::droppedFrames() const
+{
+	return _droppedFrames;
+}
+
+bool GpuProfiler::writeCsv(const std::string& path) const
+{
+	std::ofstream out(path);
+	if (!out.is_open()) return false;
+
+	out << "stage,samples,min_ms,mean_ms,p95_ms\n";
+	for (const StageStatistics& stage : statistics()) {
+		out << stage.name << "," << stage.samples << "," << stage.minMs << "," << stage.meanMs << "," << stage.p95Ms << "\n";
+	}
+	return bool(out);
+}
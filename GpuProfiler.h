@@ -0,0 +1,75 @@
+#ifndef GPU_PROFILER_H
+#define GPU_PROFILER_H
+
+#include<glad/glad.h>
+#include<deque>
+#include<ostream>
+#include<string>
+#include<unordered_map>
+#include<vector>
+
+// Measures named GPU stages with timestamp queries. Each frame's queries are
+// read back a few frames later so the CPU never waits for them, a frame whose
+// results are still not there is dropped. The last samples of every stage are
+// kept for min/mean/p95. While a Trace is recording the stages also go to it
+// on the trace clock.
+class GpuProfiler
+{
+public:
+		struct StageStatistics {
+			std::string name;
+			size_t samples;
+			double minMs;
+			double meanMs;
+			double p95Ms;
+		};
+
+		// latency: frames in flight before a frame's results are read
+		// history: samples kept per stage
+		GpuProfiler(unsigned int latency = 3, size_t history = 240);
+
+		~GpuProfiler();
+
+		// Stages are only recorded between these, beginFrame collects the
+		// results of the frame recorded 'latency' frames ago
+		void beginFrame();
+		void endFrame();
+
+		// Stages follow each other, they do not nest
+		void beginStage(const char* name);
+		void endStage();
+
+		// In order of first appearance
+		std::vector<StageStatistics> statistics() const;
+
+		void print(std::ostream& out) const;
+
+		// Frames whose results were not ready when their slot came round again
+		size_t droppedFrames() const;
+
+		// One row per stage, false when the file could not be written
+		bool writeCsv(const std::string& path) const;
+
+private:
+		struct Frame {
+			std::vector<GLuint> queries; // begin and end timestamp of each stage
+			std::vector<size_t> stages;  // stage index of each query pair
+			bool traced;                 // recorded while a Trace was running
+			double clockOffset;          // trace clock minus GPU clock, microseconds
+		};
+
+		std::vector<Frame> _frames;
+		size_t _frameIndex;
+		bool _inFrame;
+		bool _inStage;
+
+		size_t _history;
+		std::vector<std::string> _stageNames;
+		std::unordered_map<std::string, size_t> _stageIndices;
+		std::vector<std::deque<double>> _samples; // milliseconds, newest last
+		size_t _droppedFrames;
+
+		void collect(Frame& frame);
+};
+
+#endif
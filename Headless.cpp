@@ -0,0 +1,229 @@
+﻿// Runs the simulation without a window and reports its throughput, for batch
+// runs and measurements on machines without a display:
+//
+//   FluidHeadless [--steps N] [--particles N] [--warmup N] [--timings file.csv]
+//                 [--trace file.json] [--health file.csv] [--workgroups cache.txt]
+//                 [--restore checkpoint.bin] [--checkpoint checkpoint.bin]
+//                 [--cache particles.bin] [--cache-interval N]
+//
+// --particles is rounded up to a power of two, which the spatial lookup sort
+// needs. --timings prints min/mean/p95 GPU time per stage and writes them as CSV,
+// --trace writes the timed steps as a Chrome trace with CPU and GPU zones,
+// --health logs density error, kinetic energy, max speed and boundary
+// contacts of every step including the warmup, --workgroups tunes the kernel
+// workgroup sizes before the warmup or reuses the ones cached in the file.
+// --restore continues from a checkpoint instead of the initial grid,
+// --checkpoint writes the state after the timed steps, so long runs can be
+// split into several. --cache records positions and velocities of every
+// cache-interval-th step (default 1) from the warmup on, for ParticleCacheReader.
+// Needs EGL with desktop OpenGL 4.3 (Mesa llvmpipe works), on Linux e.g.
+//   g++ -std=c++17 -O2 -IDependencies/include Headless.cpp HeadlessContext.cpp
+//       Fluid.cpp ComputeShader.cpp FrameGraph.cpp GpuProfiler.cpp Trace.cpp WorkGroupTuner.cpp
+//       MappedFile.cpp ParticleCache.cpp ProgramBinaryCache.cpp glad.c -lEGL -ldl -lpthread
+// Run from the directory with the .comp files.
+#include<iostream>
+#include<glad/glad.h>
+
+#include "Fluid.h"
+#include "ComputeShader.h"
+#include "HeadlessContext.h"
+#include "GpuProfiler.h"
+#include "ParticleCache.h"
+#include "Trace.h"
+#include "WorkGroupTuner.h"
+
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <cstdlib>
+
+// Same scene as Main.cpp
+const unsigned int PARTICLE_COUNT = 1024 * 32;
+const float PARTICLE_RADIUS = 0.0075f;
+const float MASS = 0.075f;
+const float GRAVITY_ACCELERATION = 1.2f;
+const float COLLISION_DAMPING = 0.6f;
+const float BOUNDARY_X = 1.2f;
+const float BOUNDARY_Y = 0.7f;
+const float BOUNDARY_Z = 0.7f;
+const float SPACING = 0.025f;
+const float SMOOTHING_RADIUS = 0.082f;
+const float PRESSURE_MULTIPLIER = 2.0f;
+const float TARGET_DENSITY = 1000.0f;
+const float VISCOSITY_STRENGTH = 0.2f;
+const float NEAR_DENSITY_MULTIPLIER = 0.2f;
+const float DELTA_TIME = 0.016f;
+const bool INCREMENTAL_SORT = true;
+const float RESORT_THRESHOLD = 0.2f;
+const GridMode GRID_MODE = GRID_HASHED;
+const unsigned int CELL_SIZE_FACTOR = 1;
+const bool PACKED_DENSITIES = true;
+const bool QUANTIZED_POSITIONS = false;
+const bool HALF_VELOCITIES = true;
+const bool SPECIALIZED_SHADERS = true;
+const char* SHADER_CACHE_DIRECTORY = "shader_cache";
+
+const float INTERACTION_RADIUS = 0.3f;
+const float INTERACTION_STRENGTH = 15.0f;
+
+const unsigned int DEFAULT_STEPS = 1000;
+const unsigned int DEFAULT_WARMUP_STEPS = 10; // first steps compile programs and size buffers
+
+int main(int argc, char** argv) {
+	unsigned int steps = DEFAULT_STEPS;
+	unsigned int particleCount = PARTICLE_COUNT;
+	unsigned int warmupSteps = DEFAULT_WARMUP_STEPS;
+	std::string timingsFile;
+	std::string traceFile;
+	std::string healthFile;
+	std::string workGroupFile;
+	std::string restoreFile;
+	std::string checkpointFile;
+	std::string cacheFile;
+	unsigned int cacheInterval = 1;
+
+	for (int i = 1; i < argc; ++i) {
+		std::string option = argv[i];
+		if (i + 1 >= argc) {
+			std::cerr << "Missing value for " << option << "\n";
+			return -1;
+		}
+		if (option == "--timings" || option == "--trace" || option == "--health" || option == "--workgroups") {
+			(option == "--timings" ? timingsFile : option == "--trace" ? traceFile : option == "--health" ? healthFile : workGroupFile) = argv[++i];
+			continue;
+		}
+		if (option == "--restore" || option == "--checkpoint" || option == "--cache") {
+			(option == "--restore" ? restoreFile : option == "--checkpoint" ? checkpointFile : cacheFile) = argv[++i];
+			continue;
+		}
+		unsigned int value = static_cast<unsigned int>(std::strtoul(argv[++i], nullptr, 10));
+		if (option == "--steps") steps = value;
+		else if (option == "--particles") particleCount = value;
+		else if (option == "--warmup") warmupSteps = value;
+		else if (option == "--cache-interval") cacheInterval = value;
+		else {
+			std::cerr << "Unknown option " << option << "\n";
+			return -1;
+		}
+	}
+	if (steps == 0 || particleCount == 0) {
+		std::cerr << "Steps and particles must be positive\n";
+		return -1;
+	}
+	// The spatial lookup sort takes a power of two particles
+	unsigned int sortableCount = Fluid::SortableParticleCount(particleCount);
+	if (sortableCount == 0) {
+		std::cerr << "Too many particles, at most " << (MAX_INT / 2 + 1) << "\n";
+		return -1;
+	}
+	if (sortableCount != particleCount) {
+		std::cerr << "Rounding " << particleCount << " particles up to " << sortableCount << ", a power of two\n";
+		particleCount = sortableCount;
+	}
+
+	HeadlessContext context;
+	if (!context.loadGL()) {
+		std::cerr << "Failed to initialize GLAD\n";
+		return -1;
+	}
+	std::cout << "Renderer: " << glGetString(GL_RENDERER) << "\n";
+
+	ComputeShader::setBinaryCacheDirectory(SHADER_CACHE_DIRECTORY);
+	ComputeShader::enableParallelCompile((GLADloadproc)HeadlessContext::getProcAddress);
+
+	{
+		Fluid fluid(particleCount, PARTICLE_RADIUS, MASS, GRAVITY_ACCELERATION, COLLISION_DAMPING, SPACING, PRESSURE_MULTIPLIER, TARGET_DENSITY, SMOOTHING_RADIUS, particleCount * 4, INTERACTION_RADIUS, INTERACTION_STRENGTH, VISCOSITY_STRENGTH, NEAR_DENSITY_MULTIPLIER, BOUNDARY_X, BOUNDARY_Y, BOUNDARY_Z);
+		fluid.SetIncrementalSort(INCREMENTAL_SORT);
+		fluid.SetResortThreshold(RESORT_THRESHOLD);
+		fluid.SetGridMode(GRID_MODE);
+		fluid.SetCellSizeFactor(CELL_SIZE_FACTOR);
+		fluid.SetPackedDensities(PACKED_DENSITIES);
+		fluid.SetQuantizedPositions(QUANTIZED_POSITIONS);
+		fluid.SetHalfVelocities(HALF_VELOCITIES);
+		fluid.SetSpecializedShaders(SPECIALIZED_SHADERS);
+
+		if (!workGroupFile.empty()) {
+			WorkGroupTuner tuner(workGroupFile);
+			fluid.TuneWorkGroupSizes(tuner);
+			if (!tuner.save()) std::cerr << "Could not write " << workGroupFile << "\n";
+		}
+
+		if (!restoreFile.empty()) {
+			if (!fluid.RestoreCheckpoint(restoreFile)) return -1;
+			std::cout << "Restored " << restoreFile << "\n";
+		}
+
+		GpuProfiler profiler(3, steps);
+		if (!timingsFile.empty() || !traceFile.empty()) fluid.SetProfiler(&profiler);
+
+		std::ofstream healthLog;
+		if (!healthFile.empty()) {
+			healthLog.open(healthFile);
+			if (!healthLog.is_open()) {
+				std::cerr << "Could not write " << healthFile << "\n";
+				return -1;
+			}
+			fluid.SetHealthLog(&healthLog);
+			fluid.SetHealthMonitoring(true);
+		}
+
+		std::unique_ptr<ParticleCacheWriter> particleCache;
+		if (!cacheFile.empty()) {
+			particleCache = std::make_unique<ParticleCacheWriter>(cacheFile, particleCount, PARTICLE_CACHE_POSITIONS | PARTICLE_CACHE_VELOCITIES, DELTA_TIME);
+			if (!particleCache->isOpen()) {
+				std::cerr << "Could not write " << cacheFile << "\n";
+				return -1;
+			}
+			fluid.SetParticleCache(particleCache.get(), cacheInterval);
+		}
+
+		for (unsigned int i = 0; i < warmupSteps; ++i) fluid.Update(DELTA_TIME);
+		glFinish();
+
+		if (!traceFile.empty()) Trace::start();
+		auto start = std::chrono::steady_clock::now();
+		for (unsigned int i = 0; i < steps; ++i) {
+			profiler.beginFrame();
+			fluid.Update(DELTA_TIME);
+			profiler.endFrame();
+		}
+		glFinish();
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		std::cout << "Particles: " << particleCount << ", steps: " << steps << "\n";
+		std::cout << "Time: " << seconds << " s, " << steps / seconds << " steps/s, "
+			<< seconds * 1000.0 / steps << " ms/step\n";
+
+		// Collect the frames still in flight
+		for (int i = 0; i < 3; ++i) {
+			profiler.beginFrame();
+			profiler.endFrame();
+		}
+		if (!healthFile.empty()) {
+			fluid.SetHealthMonitoring(false);
+			HealthMetrics health;
+			if (fluid.GetHealthMetrics(health)) {
+				std::cout << "Health at step " << health.step << ": density error mean " << health.meanDensityError
+					<< " max " << health.maxDensityError << ", kinetic energy " << health.kineticEnergy
+					<< ", max speed " << health.maxSpeed << ", boundary particles " << health.boundaryParticles << "\n";
+			}
+			fluid.SetHealthLog(nullptr);
+		}
+		if (particleCache) {
+			fluid.SetParticleCache(nullptr, cacheInterval);
+			if (particleCache->close()) std::cout << "Wrote " << cacheFile << "\n";
+			else std::cerr << "Could not write " << cacheFile << "\n";
+		}
+		if (!checkpointFile.empty()) {
+			fluid.SaveCheckpoint(checkpointFile);
+			if (fluid.FinishCheckpoint()) std::cout << "Wrote " << checkpointFile << "\n";
+		}
+		if (!traceFile.empty() && !Trace::stop(traceFile)) std::cerr << "Could not write " << traceFile << "\n";
+		if (!timingsFile.empty()) {
+			profiler.print(std::cout);
+			if (!profiler.writeCsv(timingsFile)) std::cerr << "Could not write " << timingsFile << "\n";
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,156 @@
+#include<glad/glad.h>
+#include "HeadlessContext.h"
+#include <cstring>
+#include <iostream>
+
+#ifdef _WIN32
+
+HeadlessContext::HeadlessContext()
+	: _window(nullptr)
+{
+	if (!glfwInit()) {
+		std::cerr << "ERROR: Could not initialize GLFW\n";
+		return;
+	}
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	_window = glfwCreateWindow(1, 1, "FluidSim", nullptr, nullptr);
+	if (_window == nullptr) {
+		std::cerr << "ERROR: Could not create an OpenGL 4.3 core context\n";
+		return;
+	}
+	glfwMakeContextCurrent(_window);
+}
+
+HeadlessContext::~HeadlessContext()
+{
+	if (_window) glfwDestroyWindow(_window);
+	glfwTerminate();
+}
+
+bool HeadlessContext::isValid() const
+{
+	return _window != nullptr;
+}
+
+void* HeadlessContext::getProcAddress(const char* name)
+{
+	return reinterpret_cast<void*>(glfwGetProcAddress(name));
+}
+
+#else
+
+namespace {
+	bool HasExtension(const char* extensions, const char* name)
+	{
+		if (!extensions) return false;
+		const size_t length = std::strlen(name);
+		for (const char* at = std::strstr(extensions, name); at; at = std::strstr(at + length, name)) {
+			bool start = (at == extensions) || at[-1] == ' ';
+			bool end = at[length] == ' ' || at[length] == '\0';
+			if (start && end) return true;
+		}
+		return false;
+	}
+}
+
+HeadlessContext::HeadlessContext()
+	: _display(EGL_NO_DISPLAY), _context(EGL_NO_CONTEXT), _surface(EGL_NO_SURFACE)
+{
+	_display = openDisplay();
+	if (_display == EGL_NO_DISPLAY || !eglInitialize(_display, nullptr, nullptr)) {
+		std::cerr << "ERROR: Could not open an EGL display\n";
+		_display = EGL_NO_DISPLAY;
+		return;
+	}
+	if (!eglBindAPI(EGL_OPENGL_API)) {
+		std::cerr << "ERROR: EGL display has no desktop OpenGL\n";
+		return;
+	}
+
+	const EGLint configAttributes[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_NONE
+	};
+	EGLConfig config = nullptr;
+	EGLint configCount = 0;
+	eglChooseConfig(_display, configAttributes, &config, 1, &configCount);
+
+	const char* extensions = eglQueryString(_display, EGL_EXTENSIONS);
+	const bool surfaceless = HasExtension(extensions, "EGL_KHR_surfaceless_context");
+	if (configCount == 0) {
+		// Surfaceless displays may expose no configs at all
+		if (!surfaceless || !HasExtension(extensions, "EGL_KHR_no_config_context")) {
+			std::cerr << "ERROR: No EGL config for an offscreen OpenGL context\n";
+			return;
+		}
+		config = EGL_NO_CONFIG_KHR;
+	}
+
+	const EGLint contextAttributes[] = {
+		EGL_CONTEXT_MAJOR_VERSION, 4,
+		EGL_CONTEXT_MINOR_VERSION, 3,
+		EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+		EGL_NONE
+	};
+	_context = eglCreateContext(_display, config, EGL_NO_CONTEXT, contextAttributes);
+	if (_context == EGL_NO_CONTEXT) {
+		std::cerr << "ERROR: Could not create an OpenGL 4.3 core context\n";
+		return;
+	}
+
+	// Compute only needs a current context, a pbuffer stands in for drivers
+	// that insist on a surface
+	if (!surfaceless) {
+		const EGLint pbufferAttributes[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+		_surface = eglCreatePbufferSurface(_display, config, pbufferAttributes);
+	}
+	if (!eglMakeCurrent(_display, _surface, _surface, _context)) {
+		std::cerr << "ERROR: Could not make the offscreen context current\n";
+		eglDestroyContext(_display, _context);
+		_context = EGL_NO_CONTEXT;
+	}
+}
+
+HeadlessContext::~HeadlessContext()
+{
+	if (_display == EGL_NO_DISPLAY) return;
+	eglMakeCurrent(_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	if (_surface != EGL_NO_SURFACE) eglDestroySurface(_display, _surface);
+	if (_context != EGL_NO_CONTEXT) eglDestroyContext(_display, _context);
+	eglTerminate(_display);
+}
+
+bool HeadlessContext::isValid() const
+{
+	return _context != EGL_NO_CONTEXT;
+}
+
+void* HeadlessContext::getProcAddress(const char* name)
+{
+	return reinterpret_cast<void*>(eglGetProcAddress(name));
+}
+
+EGLDisplay HeadlessContext::openDisplay() const
+{
+	const char* clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+	if (HasExtension(clientExtensions, "EGL_MESA_platform_surfaceless")) {
+		PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+			reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(eglGetProcAddress("eglGetPlatformDisplayEXT"));
+		if (getPlatformDisplay) {
+			EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+			if (display != EGL_NO_DISPLAY) return display;
+		}
+	}
+	return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+}
+
+#endif
+
+bool HeadlessContext::loadGL() const
+{
+	return isValid() && gladLoadGLLoader((GLADloadproc)getProcAddress);
+}
@@ -0,0 +1,43 @@
+#ifndef HEADLESS_CONTEXT_H
+#define HEADLESS_CONTEXT_H
+
+#ifdef _WIN32
+#include<GLFW/glfw3.h>
+#else
+#include<EGL/egl.h>
+#include<EGL/eglext.h>
+#endif
+
+// OpenGL 4.3 core context without a window or display server, through EGL.
+// Uses Mesa's surfaceless platform when available (llvmpipe works), otherwise
+// the default display with a 1x1 pbuffer. Windows has no EGL for desktop GL,
+// there it is the context of a hidden GLFW window. Current on the creating
+// thread.
+class HeadlessContext
+{
+public:
+		HeadlessContext();
+
+		~HeadlessContext();
+
+		// False when no display or context could be created, see stderr
+		bool isValid() const;
+
+		// Loads GL entry points with glad
+		bool loadGL() const;
+
+		static void* getProcAddress(const char* name);
+
+private:
+#ifdef _WIN32
+		GLFWwindow* _window;
+#else
+		EGLDisplay _display;
+		EGLContext _context;
+		EGLSurface _surface;
+
+		EGLDisplay openDisplay() const;
+#endif
+};
+
+#endif
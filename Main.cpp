@@ -7,6 +7,10 @@
 #include "Fluid.h"
 #include"shaderClass.h"
 #include"ComputeShader.h"
+#include"GpuProfiler.h"
+#include"ParticleCache.h"
+#include"Trace.h"
+#include"WorkGroupTuner.h"
 #include"VAO.h"
 #include"VBO.h"
 #include"EBO.h"
@@ -15,6 +19,11 @@
 
 #include <vector>
 #include <cmath>
+#include <string>
+#include <fstream>
+#include <limits>
+#include <algorithm>
+#include <memory>
 
 // influence = SmoothingKernel(smoothingRadius, distance)
 // density += influence * mass;
@@ -27,7 +36,10 @@
 
 const unsigned int WIDTH = 1920, HEIGHT = 1080;
 const unsigned int PARTICLE_COUNT = 1024 * 32;
-const unsigned int SPATIAL_HASH_SIZE = PARTICLE_COUNT * 4;
+const unsigned int SPATIAL_HASH_SIZE = PARTICLE_COUNT * 4; // starting size, replaced by the tuned one below
+const float HASH_TARGET_COLLISION_RATE = 0.02f; // occupied buckets allowed to hold more than one cell
+const size_t HASH_MEMORY_BUDGET = 32 * 1024 * 1024; // bytes of cell ranges the hash tuner may use, 0 keeps SPATIAL_HASH_SIZE
+const unsigned int HASH_RETUNE_INTERVAL = 600; // steps between hash tunings as the fluid spreads, 0 only at startup
 const float PARTICLE_RADIUS = 0.0075f;
 const float MASS = 0.075f;
 const float GRAVITY_ACCELERATION = 1.2f;
@@ -42,6 +54,24 @@ const float TARGET_DENSITY = 1000.0f;
 const float VISCOSITY_STRENGTH = 0.2f;
 const float NEAR_DENSITY_MULTIPLIER = 0.2f;
 const float DELTA_TIME = 0.016f;
+const bool INCREMENTAL_SORT = true;
+const float RESORT_THRESHOLD = 0.2f; // fraction of changed keys above which a full sort is used
+const GridMode GRID_MODE = GRID_HASHED; // GRID_SPARSE for large or unbounded domains
+const unsigned int CELL_SIZE_FACTOR = 1; // grid cells per smoothing radius (1-3)
+const bool PACKED_DENSITIES = true; // keep densities in the w lanes of predicted positions and velocities
+const bool QUANTIZED_POSITIONS = false; // 16-bit cell relative positions in the neighbor loops
+const bool HALF_VELOCITIES = true; // fp16 velocity copy for viscosity and rendering
+const bool SPECIALIZED_SHADERS = true; // bake radius, mass, grid size and kernel factors into the hot shaders
+const char* SHADER_CACHE_DIRECTORY = "shader_cache"; // linked compute programs, empty to always compile
+const unsigned int SHADER_COMPILE_WORKERS = 3; // shared contexts linking programs when the driver can't compile in parallel
+const char* GPU_TIMINGS_FILE = "gpu_timings.csv"; // written with the printed stage timings on T
+const char* TRACE_FILE = "trace.json"; // C starts a capture, C again writes it
+const char* WORK_GROUP_CACHE_FILE = "workgroup_sizes.txt"; // kernel workgroup sizes tuned on the first run per device and particle count, empty to keep the shaders' own
+const char* HEALTH_LOG_FILE = "health.csv"; // density error, energy and boundary contacts per step, empty to skip
+const char* CHECKPOINT_FILE = "checkpoint.bin"; // K writes the simulation state in the background, L continues from it
+const char* PARTICLE_CACHE_FILE = "particle_cache.bin"; // R starts recording frames for offline tools, R again closes the file
+const unsigned int PARTICLE_CACHE_INTERVAL = 4; // steps between recorded frames
+const uint32_t PARTICLE_CACHE_ATTRIBUTES = PARTICLE_CACHE_POSITIONS | PARTICLE_CACHE_VELOCITIES;
 
 const float INTERACTION_RADIUS = 0.3f;
 const float INTERACTION_STRENGTH = 15.0f;
@@ -54,6 +84,11 @@ bool vLastFrame = false;
 bool bLastFrame = false;
 bool nLastFrame = false;
 bool mLastFrame = false;
+bool tLastFrame = false;
+bool cLastFrame = false;
+bool kLastFrame = false;
+bool lLastFrame = false;
+bool rLastFrame = false;
 
 const float FOV = 60.0f;
 const float MOVEMENT_SPEED = 2.0f;
@@ -111,8 +146,127 @@ static void CreateUVSphere(std::vector<glm::vec3>& verts,
 	}
 }
 
+// Times the full step for every cell size factor at a few particle densities
+// and prints the fastest factor for each, run with --cell-sweep
+static void RunCellSizeSweep()
+{
+	const float spacings[] = { 0.02f, 0.025f, 0.035f, 0.05f };
+	const int warmupSteps = 10;
+	const int timedSteps = 50;
+
+	std::cout << "spacing, particles per h^3, cells per h, neighbor cells, ms per step\n";
+	for (float spacing : spacings) {
+		float particlesPerVolume = std::pow(SMOOTHING_RADIUS / spacing, 3.0f);
+		unsigned int bestFactor = 1;
+		double bestTime = std::numeric_limits<double>::max();
+
+		for (unsigned int factor = 1; factor <= 3; ++factor) {
+			Fluid fluid(PARTICLE_COUNT, PARTICLE_RADIUS, MASS, GRAVITY_ACCELERATION, COLLISION_DAMPING, spacing, PRESSURE_MULTIPLIER, TARGET_DENSITY, SMOOTHING_RADIUS, SPATIAL_HASH_SIZE, INTERACTION_RADIUS, INTERACTION_STRENGTH, VISCOSITY_STRENGTH, NEAR_DENSITY_MULTIPLIER, BOUNDARY_X, BOUNDARY_Y, BOUNDARY_Z);
+			fluid.SetGridMode(GRID_MODE);
+			fluid.SetCellSizeFactor(factor);
+
+			for (int i = 0; i < warmupSteps; ++i) fluid.Update(DELTA_TIME);
+			glFinish();
+
+			double start = glfwGetTime();
+			for (int i = 0; i < timedSteps; ++i) fluid.Update(DELTA_TIME);
+			glFinish();
+			double msPerStep = (glfwGetTime() - start) * 1000.0 / timedSteps;
+
+			std::cout << spacing << ", " << particlesPerVolume << ", " << factor << ", " << fluid.GetNeighborCellCount() << ", " << msPerStep << "\n";
+			if (msPerStep < bestTime) {
+				bestTime = msPerStep;
+				bestFactor = factor;
+			}
+		}
+		std::cout << "best cells per h at spacing " << spacing << ": " << bestFactor << "\n";
+	}
+}
 
-int main() {
+// Runs the default scene with quantized positions and prints their error
+// against full float every few steps, run with --quantization-report
+static void RunQuantizationReport()
+{
+	const int reportInterval = 50;
+	const int reports = 6;
+
+	Fluid fluid(PARTICLE_COUNT, PARTICLE_RADIUS, MASS, GRAVITY_ACCELERATION, COLLISION_DAMPING, SPACING, PRESSURE_MULTIPLIER, TARGET_DENSITY, SMOOTHING_RADIUS, SPATIAL_HASH_SIZE, INTERACTION_RADIUS, INTERACTION_STRENGTH, VISCOSITY_STRENGTH, NEAR_DENSITY_MULTIPLIER, BOUNDARY_X, BOUNDARY_Y, BOUNDARY_Z);
+	fluid.SetGridMode(GRID_MODE);
+	fluid.SetCellSizeFactor(CELL_SIZE_FACTOR);
+	fluid.SetPackedDensities(PACKED_DENSITIES);
+	if (!fluid.SetQuantizedPositions(true)) return;
+
+	std::cout << "step, max position error / h, rms position error / h, max density error, rms density error\n";
+	for (int r = 1; r <= reports; ++r) {
+		for (int i = 0; i < reportInterval; ++i) fluid.Update(DELTA_TIME);
+
+		QuantizationError error = fluid.MeasureQuantizationError();
+		std::cout << r * reportInterval << ", "
+			<< error.maxPositionError / SMOOTHING_RADIUS << ", " << error.rmsPositionError / SMOOTHING_RADIUS << ", "
+			<< error.maxDensityError << ", " << error.rmsDensityError << "\n";
+	}
+}
+
+// Runs the default scene and prints neighbor search statistics every few
+// steps, then the histograms of the last report, run with --neighbor-report
+static void RunNeighborReport()
+{
+	const int reportInterval = 50;
+	const int reports = 6;
+
+	Fluid fluid(PARTICLE_COUNT, PARTICLE_RADIUS, MASS, GRAVITY_ACCELERATION, COLLISION_DAMPING, SPACING, PRESSURE_MULTIPLIER, TARGET_DENSITY, SMOOTHING_RADIUS, SPATIAL_HASH_SIZE, INTERACTION_RADIUS, INTERACTION_STRENGTH, VISCOSITY_STRENGTH, NEAR_DENSITY_MULTIPLIER, BOUNDARY_X, BOUNDARY_Y, BOUNDARY_Z);
+	fluid.SetIncrementalSort(INCREMENTAL_SORT);
+	fluid.SetGridMode(GRID_MODE);
+	fluid.SetCellSizeFactor(CELL_SIZE_FACTOR);
+
+	NeighborStatistics stats = {};
+	std::cout << "step, candidates, neighbors, neighbors / candidates, occupied cells, bucket load, foreign candidate rate, collided bucket rate, merged cells\n";
+	for (int r = 1; r <= reports; ++r) {
+		for (int i = 0; i < reportInterval; ++i) fluid.Update(DELTA_TIME);
+
+		stats = fluid.MeasureNeighborStatistics();
+		std::cout << r * reportInterval << ", " << stats.meanCandidates << ", " << stats.meanNeighbors << ", "
+			<< stats.meanNeighbors / std::max(stats.meanCandidates, 1.0f) << ", " << stats.meanOccupiedCells << ", "
+			<< stats.meanBucketLoad << ", " << stats.foreignCandidateRate << ", " << stats.collidedBucketRate << ", "
+			<< stats.mergedCells << "\n";
+	}
+
+	std::cout << "\ncount, particles by candidates, by neighbors, by occupied cells, buckets by load\n";
+	for (unsigned int bin = 0; bin < NEIGHBOR_STAT_BINS; ++bin) {
+		if (!stats.candidates[bin] && !stats.neighbors[bin] && !stats.occupiedCells[bin] && !stats.bucketLoad[bin]) continue;
+		std::cout << bin << (bin + 1 == NEIGHBOR_STAT_BINS ? "+" : "") << ", " << stats.candidates[bin] << ", " << stats.neighbors[bin] << ", "
+			<< stats.occupiedCells[bin] << ", " << stats.bucketLoad[bin] << "\n";
+	}
+}
+
+
+// Compute programs are compiled in the background from here on, by the driver
+// or on hidden windows whose contexts share objects with the main one
+static std::vector<GLFWwindow*> StartShaderCompilation(GLFWwindow* window) {
+	std::vector<GLFWwindow*> workers;
+	if (ComputeShader::enableParallelCompile((GLADloadproc)glfwGetProcAddress)) return workers;
+
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	std::vector<CompileContext> contexts;
+	for (unsigned int i = 0; i < SHADER_COMPILE_WORKERS; ++i) {
+		GLFWwindow* worker = glfwCreateWindow(1, 1, "Shader Compiler", NULL, window);
+		if (worker == NULL) break;
+		workers.push_back(worker);
+		contexts.push_back([worker](bool current) { glfwMakeContextCurrent(current ? worker : NULL); });
+	}
+	glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+
+	ComputeShader::startCompileWorkers(std::move(contexts));
+	return workers;
+}
+
+static void StopShaderCompilation(std::vector<GLFWwindow*>& workers) {
+	ComputeShader::stopCompileWorkers();
+	for (GLFWwindow* worker : workers) glfwDestroyWindow(worker);
+	workers.clear();
+}
+
+int main(int argc, char** argv) {
 	glfwInit();
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
@@ -135,6 +289,19 @@ int main() {
 	glViewport(0, 0, WIDTH, HEIGHT);
 	glEnable(GL_DEPTH_TEST);
 
+	ComputeShader::setBinaryCacheDirectory(SHADER_CACHE_DIRECTORY);
+	std::vector<GLFWwindow*> compileWorkers = StartShaderCompilation(window);
+
+	if (argc > 1 && (std::string(argv[1]) == "--cell-sweep" || std::string(argv[1]) == "--quantization-report" || std::string(argv[1]) == "--neighbor-report")) {
+		if (std::string(argv[1]) == "--cell-sweep") RunCellSizeSweep();
+		else if (std::string(argv[1]) == "--quantization-report") RunQuantizationReport();
+		else RunNeighborReport();
+		StopShaderCompilation(compileWorkers);
+		glfwDestroyWindow(window);
+		glfwTerminate();
+		return 0;
+	}
+
 	Shader shaderProgram("default.vert", "default.frag");
 
 	Shader lineShader("line.vert", "line.frag");
@@ -175,6 +342,49 @@ int main() {
 	glBindVertexArray(0);
 
 	Fluid fluid(PARTICLE_COUNT, PARTICLE_RADIUS, MASS, GRAVITY_ACCELERATION, COLLISION_DAMPING, SPACING, PRESSURE_MULTIPLIER, TARGET_DENSITY, SMOOTHING_RADIUS, SPATIAL_HASH_SIZE, INTERACTION_RADIUS, INTERACTION_STRENGTH, VISCOSITY_STRENGTH, NEAR_DENSITY_MULTIPLIER, BOUNDARY_X, BOUNDARY_Y, BOUNDARY_Z);
+	fluid.SetIncrementalSort(INCREMENTAL_SORT);
+	fluid.SetResortThreshold(RESORT_THRESHOLD);
+	fluid.SetGridMode(GRID_MODE);
+	fluid.SetCellSizeFactor(CELL_SIZE_FACTOR);
+	fluid.SetPackedDensities(PACKED_DENSITIES);
+	fluid.SetQuantizedPositions(QUANTIZED_POSITIONS);
+	fluid.SetHalfVelocities(HALF_VELOCITIES);
+	fluid.SetSpecializedShaders(SPECIALIZED_SHADERS);
+
+	// Keep the window responsive while the programs finish compiling
+	while (!fluid.ShadersReady() && !glfwWindowShouldClose(window)) {
+		glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+		glfwSwapBuffers(window);
+		glfwPollEvents();
+	}
+	StopShaderCompilation(compileWorkers);
+
+	if (HASH_MEMORY_BUDGET) {
+		HashSizeChoice hash = fluid.TuneHashSize(HASH_TARGET_COLLISION_RATE, HASH_MEMORY_BUDGET);
+		std::cout << "Hash size " << hash.hashSize << (hash.mixed ? " mixed" : "") << ", collided buckets "
+			<< hash.collidedBucketRate << ", candidates per particle " << hash.meanCandidates << "\n";
+		fluid.SetHashRetuneInterval(HASH_RETUNE_INTERVAL);
+	}
+
+	if (WORK_GROUP_CACHE_FILE[0]) {
+		WorkGroupTuner tuner(WORK_GROUP_CACHE_FILE);
+		fluid.TuneWorkGroupSizes(tuner);
+		if (!tuner.save()) std::cerr << "Could not write " << WORK_GROUP_CACHE_FILE << "\n";
+	}
+
+	GpuProfiler profiler;
+	fluid.SetProfiler(&profiler);
+
+	std::ofstream healthLog;
+	if (HEALTH_LOG_FILE[0]) {
+		healthLog.open(HEALTH_LOG_FILE);
+		if (healthLog.is_open()) fluid.SetHealthLog(&healthLog);
+		else std::cerr << "Could not write " << HEALTH_LOG_FILE << "\n";
+	}
+	fluid.SetHealthMonitoring(true);
+
+	std::unique_ptr<ParticleCacheWriter> particleCache;
 
 	std::vector<glm::vec3> sphereVertices;
 	std::vector<GLuint> sphereIndices;
@@ -199,11 +409,18 @@ int main() {
 	int  nbFrames = 0;
 
 	while (!glfwWindowShouldClose(window)) {
+		TRACE_ZONE("frame");
+		profiler.beginFrame();
+
 		double currentTime = glfwGetTime();
 		nbFrames++;
 		if (currentTime - lastTime >= 1.0) {
 			int fps = nbFrames;
-			std::string title = "Fluid Particles -> FPS: " + std::to_string(fps);
+			double gpuMs = 0.0;
+			for (const GpuProfiler::StageStatistics& stage : profiler.statistics()) gpuMs += stage.meanMs;
+			std::string title = "Fluid Particles -> FPS: " + std::to_string(fps) + ", GPU: " + std::to_string(gpuMs) + " ms";
+			HealthMetrics health;
+			if (fluid.GetHealthMetrics(health)) title += ", density error: " + std::to_string(100.0f * health.meanDensityError) + "%";
 			glfwSetWindowTitle(window, title.c_str());
 			nbFrames = 0;
 			lastTime += 1.0;
@@ -279,6 +496,57 @@ int main() {
 			fluid.SetPaused(false);
 		}
 
+		int tState = glfwGetKey(window, GLFW_KEY_T);
+		if (tState == GLFW_PRESS && !tLastFrame) {
+			profiler.print(std::cout);
+			if (!profiler.writeCsv(GPU_TIMINGS_FILE)) std::cerr << "Could not write " << GPU_TIMINGS_FILE << "\n";
+		}
+		tLastFrame = (tState == GLFW_PRESS);
+
+		int cState = glfwGetKey(window, GLFW_KEY_C);
+		if (cState == GLFW_PRESS && !cLastFrame) {
+			if (!Trace::enabled()) Trace::start();
+			else if (Trace::stop(TRACE_FILE)) std::cout << "Wrote " << TRACE_FILE << "\n";
+			else std::cerr << "Could not write " << TRACE_FILE << "\n";
+		}
+		cLastFrame = (cState == GLFW_PRESS);
+
+		int kState = glfwGetKey(window, GLFW_KEY_K);
+		if (kState == GLFW_PRESS && !kLastFrame) {
+			if (fluid.SaveCheckpoint(CHECKPOINT_FILE)) std::cout << "Saving " << CHECKPOINT_FILE << "\n";
+			else std::cerr << "Still writing the last checkpoint\n";
+		}
+		kLastFrame = (kState == GLFW_PRESS);
+
+		int lState = glfwGetKey(window, GLFW_KEY_L);
+		if (lState == GLFW_PRESS && !lLastFrame) {
+			fluid.FinishCheckpoint();
+			if (fluid.RestoreCheckpoint(CHECKPOINT_FILE)) std::cout << "Restored " << CHECKPOINT_FILE << "\n";
+		}
+		lLastFrame = (lState == GLFW_PRESS);
+
+		int rState = glfwGetKey(window, GLFW_KEY_R);
+		if (rState == GLFW_PRESS && !rLastFrame) {
+			if (!particleCache) {
+				particleCache = std::make_unique<ParticleCacheWriter>(PARTICLE_CACHE_FILE, PARTICLE_COUNT, PARTICLE_CACHE_ATTRIBUTES, DELTA_TIME);
+				if (particleCache->isOpen()) {
+					fluid.SetParticleCache(particleCache.get(), PARTICLE_CACHE_INTERVAL);
+					std::cout << "Recording " << PARTICLE_CACHE_FILE << "\n";
+				}
+				else {
+					std::cerr << "Could not write " << PARTICLE_CACHE_FILE << "\n";
+					particleCache.reset();
+				}
+			}
+			else {
+				fluid.SetParticleCache(nullptr, PARTICLE_CACHE_INTERVAL);
+				if (particleCache->close()) std::cout << "Wrote " << PARTICLE_CACHE_FILE << "\n";
+				else std::cerr << "Could not write " << PARTICLE_CACHE_FILE << "\n";
+				particleCache.reset();
+			}
+		}
+		rLastFrame = (rState == GLFW_PRESS);
+
 		if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS) {
 			glfwSetWindowShouldClose(window, true);
 		}
@@ -353,17 +621,17 @@ int main() {
 		}
 		// ------------------------------------------------------------
 
-		fluid.Update(DELTA_TIME);
-
 		shaderProgram.Activate();
 		glUniformMatrix4fv(glGetUniformLocation(shaderProgram.ID, "view"), 1, GL_FALSE, glm::value_ptr(view));
 		glUniformMatrix4fv(glGetUniformLocation(shaderProgram.ID, "projection"), 1, GL_FALSE, glm::value_ptr(projection));
 		glUniformMatrix4fv(glGetUniformLocation(shaderProgram.ID, "model"), 1, GL_FALSE, glm::value_ptr(model));
 
 
+		profiler.beginStage("render");
 		fluid.BindRenderBuffers();
 		vao1.Bind();
 		glUniform1f(glGetUniformLocation(shaderProgram.ID, "scale"), PARTICLE_RADIUS);
+		glUniform1i(glGetUniformLocation(shaderProgram.ID, "useHalfVelocities"), fluid.GetHalfVelocities());
 		glDrawElementsInstanced(GL_TRIANGLES, GLsizei(sphereIndices.size()), GL_UNSIGNED_INT, 0, PARTICLE_COUNT);
 
 		lineShader.Activate();
@@ -374,10 +642,29 @@ int main() {
 		glBindVertexArray(boundaryVAO);
 		glDrawArrays(GL_LINES, 0, boundaryLines.size());
 		glBindVertexArray(0);
+		profiler.endStage();
 
-		glfwSwapBuffers(window);
-		glfwPollEvents();
+		// Step after drawing: the draw reads the current state while the step
+		// writes the other copy, so both can be in flight together
+		fluid.Update(DELTA_TIME);
+		profiler.endFrame();
+
+		{
+			TRACE_ZONE("swap buffers");
+			glfwSwapBuffers(window);
+		}
+		{
+			TRACE_ZONE("poll events");
+			glfwPollEvents();
+		}
+	}
+	if (Trace::enabled()) Trace::stop(TRACE_FILE);
+	if (particleCache) {
+		fluid.SetParticleCache(nullptr, PARTICLE_CACHE_INTERVAL);
+		if (!particleCache->close()) std::cerr << "Could not write " << PARTICLE_CACHE_FILE << "\n";
 	}
+	fluid.SetHealthMonitoring(false);
+	fluid.SetHealthLog(nullptr);
 
 	vao1.Delete();
 	vboSphere.Delete();
@@ -0,0 +1,56 @@
+#include "MappedFile.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+
+MappedFile::MappedFile(const std::string& path)
+	: _file(INVALID_HANDLE_VALUE), _mapping(nullptr), _data(nullptr), _size(0)
+{
+	_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (_file == INVALID_HANDLE_VALUE) return;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(_file, &size) || size.QuadPart == 0) return;
+
+	_mapping = CreateFileMappingA(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (!_mapping) return;
+	_data = static_cast<const unsigned char*>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+	if (_data) _size = static_cast<size_t>(size.QuadPart);
+}
+
+MappedFile::~MappedFile()
+{
+	if (_data) UnmapViewOfFile(_data);
+	if (_mapping) CloseHandle(_mapping);
+	if (_file != INVALID_HANDLE_VALUE) CloseHandle(_file);
+}
+
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile(const std::string& path)
+	: _file(-1), _data(nullptr), _size(0)
+{
+	_file = open(path.c_str(), O_RDONLY);
+	if (_file < 0) return;
+
+	struct stat status;
+	if (fstat(_file, &status) != 0 || status.st_size == 0) return;
+
+	void* view = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_PRIVATE, _file, 0);
+	if (view == MAP_FAILED) return;
+	_data = static_cast<const unsigned char*>(view);
+	_size = static_cast<size_t>(status.st_size);
+}
+
+MappedFile::~MappedFile()
+{
+	if (_data) munmap(const_cast<unsigned char*>(_data), _size);
+	if (_file >= 0) close(_file);
+}
+#endif
@@ -0,0 +1,35 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include<cstddef>
+#include<string>
+
+// Read-only view of a whole file mapped into memory. Pages are read from disk
+// when first touched, so opening a large file costs nothing up front and
+// copying from data() goes straight from the page cache.
+class MappedFile
+{
+public:
+		explicit MappedFile(const std::string& path);
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		// False when the file could not be opened or is empty
+		bool isOpen() const { return _data != nullptr; }
+		const unsigned char* data() const { return _data; }
+		size_t size() const { return _size; }
+
+private:
+#ifdef _WIN32
+		void* _file;    // HANDLE
+		void* _mapping; // HANDLE
+#else
+		int _file;
+#endif
+		const unsigned char* _data;
+		size_t _size;
+};
+
+#endif
@@ -0,0 +1,194 @@
+#include "ParticleCache.h"
+#include <cstring>
+
+namespace {
+	const char PARTICLE_CACHE_MAGIC[4] = { 'F', 'S', 'P', 'C' };
+	const size_t MAX_QUEUED_FRAMES = 4;
+	const uint32_t KNOWN_ATTRIBUTES = PARTICLE_CACHE_POSITIONS | PARTICLE_CACHE_VELOCITIES;
+
+	uint64_t PayloadSize(uint32_t attributes, unsigned int particleCount)
+	{
+		uint64_t arrays = 0;
+		for (uint32_t flag = 1; flag <= KNOWN_ATTRIBUTES; flag <<= 1) {
+			if (attributes & flag) ++arrays;
+		}
+		return arrays * particleCount * 3 * sizeof(float);
+	}
+}
+
+ParticleCacheWriter::ParticleCacheWriter(const std::string& path, unsigned int particleCount, uint32_t attributes, float timeStep)
+	: _file(path, std::ios::binary | std::ios::trunc), _particleCount(particleCount), _attributes(attributes & KNOWN_ATTRIBUTES),
+	  _timeStep(timeStep), _written(0), _failed(false), _closing(false)
+{
+	if (!_file.is_open()) return;
+	writeHeader(0, 0);
+	_written = sizeof(ParticleCacheHeader);
+	_worker = std::thread(&ParticleCacheWriter::run, this);
+}
+
+ParticleCacheWriter::~ParticleCacheWriter()
+{
+	close();
+}
+
+void ParticleCacheWriter::append(unsigned int step, std::vector<glm::vec4> positions, std::vector<glm::vec4> velocities)
+{
+	if (!_worker.joinable()) return;
+	std::unique_lock<std::mutex> lock(_mutex);
+	_freed.wait(lock, [this]() { return _queue.size() < MAX_QUEUED_FRAMES; });
+	_queue.push_back(Frame{ step, std::move(positions), std::move(velocities) });
+	lock.unlock();
+	_queued.notify_one();
+}
+
+bool ParticleCacheWriter::close()
+{
+	if (!_worker.joinable()) return _closing && !_failed;
+
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_closing = true;
+	}
+	_queued.notify_one();
+	_worker.join();
+
+	// The index goes last so frames can stream out before their count is known
+	const uint64_t indexOffset = _written;
+	_file.write(reinterpret_cast<const char*>(_index.data()), _index.size() * sizeof(ParticleCacheIndexEntry));
+	_file.seekp(0);
+	writeHeader(static_cast<uint32_t>(_index.size()), indexOffset);
+	_file.close();
+	_failed = _failed || _file.fail();
+	return !_failed;
+}
+
+void ParticleCacheWriter::run()
+{
+	std::vector<float> scratch;
+	for (;;) {
+		std::unique_lock<std::mutex> lock(_mutex);
+		_queued.wait(lock, [this]() { return !_queue.empty() || _closing; });
+		if (_queue.empty()) return;
+		Frame frame = std::move(_queue.front());
+		_queue.pop_front();
+		lock.unlock();
+		_freed.notify_one();
+
+		writeFrame(frame, scratch);
+	}
+}
+
+// Only xyz is kept, w holds packed densities or nothing
+void ParticleCacheWriter::writeFrame(const Frame& frame, std::vector<float>& scratch)
+{
+	ParticleCacheFrameHeader header = {};
+	header.step = frame.step;
+	header.payloadSize = 0;
+	scratch.clear();
+	for (const auto& attribute : { std::make_pair(PARTICLE_CACHE_POSITIONS, &frame.positions),
+	                               std::make_pair(PARTICLE_CACHE_VELOCITIES, &frame.velocities) }) {
+		if (!(_attributes & attribute.first) || attribute.second->size() < _particleCount) continue;
+		for (unsigned int i = 0; i < _particleCount; ++i) {
+			const glm::vec4& value = (*attribute.second)[i];
+			scratch.insert(scratch.end(), { value.x, value.y, value.z });
+		}
+		header.attributes |= attribute.first;
+	}
+	header.payloadSize = scratch.size() * sizeof(float);
+
+	_index.push_back(ParticleCacheIndexEntry{ _written, frame.step, 0 });
+	_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	_file.write(reinterpret_cast<const char*>(scratch.data()), header.payloadSize);
+	_written += sizeof(header) + header.payloadSize;
+	// Whole frames reach the file as they come, a reader can open it mid-run
+	_file.flush();
+	_failed = _failed || _file.fail();
+}
+
+void ParticleCacheWriter::writeHeader(uint32_t frameCount, uint64_t indexOffset)
+{
+	ParticleCacheHeader header = {};
+	std::memcpy(header.magic, PARTICLE_CACHE_MAGIC, sizeof(header.magic));
+	header.version = PARTICLE_CACHE_VERSION;
+	header.particleCount = _particleCount;
+	header.attributes = _attributes;
+	header.timeStep = _timeStep;
+	header.frameCount = frameCount;
+	header.indexOffset = indexOffset;
+	_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	_failed = _failed || _file.fail();
+}
+
+ParticleCacheReader::ParticleCacheReader(const std::string& path)
+	: _file(path), _valid(false), _header{}, _index(nullptr)
+{
+	if (!_file.isOpen() || _file.size() < sizeof(ParticleCacheHeader)) return;
+	std::memcpy(&_header, _file.data(), sizeof(_header));
+	if (std::memcmp(_header.magic, PARTICLE_CACHE_MAGIC, sizeof(_header.magic)) != 0 || _header.version != PARTICLE_CACHE_VERSION) return;
+
+	const uint64_t indexSize = uint64_t(_header.frameCount) * sizeof(ParticleCacheIndexEntry);
+	if (_header.indexOffset == 0) scanFrames();
+	else if (_header.indexOffset <= _file.size() && indexSize <= _file.size() - _header.indexOffset) _index = _file.data() + _header.indexOffset;
+	else {
+		// A closed cache cut short, e.g. a partial copy, has no usable index
+		_header.frameCount = 0;
+		return;
+	}
+	_valid = true;
+}
+
+unsigned int ParticleCacheReader::frameCount() const
+{
+	return _valid ? _header.frameCount : 0;
+}
+
+unsigned int ParticleCacheReader::step(unsigned int frame) const
+{
+	if (frame >= frameCount()) return 0;
+	ParticleCacheIndexEntry entry;
+	std::memcpy(&entry, _index + size_t(frame) * sizeof(entry), sizeof(entry));
+	return entry.step;
+}
+
+const float* ParticleCacheReader::positions(unsigned int frame) const
+{
+	return attribute(frame, PARTICLE_CACHE_POSITIONS);
+}
+
+const float* ParticleCacheReader::velocities(unsigned int frame) const
+{
+	return attribute(frame, PARTICLE_CACHE_VELOCITIES);
+}
+
+// One index lookup, then the arrays of the lower flags are skipped
+const float* ParticleCacheReader::attribute(unsigned int frame, uint32_t attribute) const
+{
+	if (frame >= frameCount()) return nullptr;
+	ParticleCacheIndexEntry entry;
+	std::memcpy(&entry, _index + size_t(frame) * sizeof(entry), sizeof(entry));
+	if (entry.offset > _file.size() || _file.size() - entry.offset < sizeof(ParticleCacheFrameHeader)) return nullptr;
+
+	ParticleCacheFrameHeader header;
+	std::memcpy(&header, _file.data() + entry.offset, sizeof(header));
+	if (!(header.attributes & attribute) || header.payloadSize != PayloadSize(header.attributes, _header.particleCount) ||
+		_file.size() - entry.offset - sizeof(header) < header.payloadSize) return nullptr;
+
+	const uint64_t skipped = PayloadSize(header.attributes & (attribute - 1), _header.particleCount);
+	return reinterpret_cast<const float*>(_file.data() + entry.offset + sizeof(header) + skipped);
+}
+
+// Walks the chunks of a cache whose writer did not finish, stopping at the
+// first one cut short
+void ParticleCacheReader::scanFrames()
+{
+	uint64_t offset = sizeof(ParticleCacheHeader);
+	while (_file.size() - offset >= sizeof(ParticleCacheFrameHeader)) {
+		ParticleCacheFrameHeader header;
+		std::memcpy(&header, _file.data() + offset, sizeof(header));
+		if (header.payloadSize > _file.size() - offset - sizeof(header)) break;
+		_scannedIndex.push_back(ParticleCacheIndexEntry{ offset, header.step, 0 });
+		offset += sizeof(header) + header.payloadSize;
+	}
+	_header.frameCount = static_cast<uint32_t>(_scannedIndex.size());
+	_index = reinterpret_cast<const unsigned char*>(_scannedIndex.data());
+}
@@ -0,0 +1,144 @@
+#ifndef PARTICLE_CACHE_H
+#define PARTICLE_CACHE_H
+
+#include<glm/glm.hpp>
+#include<condition_variable>
+#include<cstdint>
+#include<deque>
+#include<fstream>
+#include<mutex>
+#include<string>
+#include<thread>
+#include<vector>
+
+#include "MappedFile.h"
+
+// Particle sequences for offline rendering and analysis. A cache file holds,
+// in native byte order, a ParticleCacheHeader, the frames back to back and
+// the index. A frame is a ParticleCacheFrameHeader followed by particleCount
+// x, y, z floats for each attribute flag it has, from the lowest bit up. The
+// index has a ParticleCacheIndexEntry per frame.
+//
+// Frame count and index are written when the cache is closed. A file whose
+// writer never closed it has them zero, readers then find the frames by
+// walking the chunks.
+enum ParticleCacheAttribute : uint32_t {
+	PARTICLE_CACHE_POSITIONS = 1,
+	PARTICLE_CACHE_VELOCITIES = 2
+};
+
+const uint32_t PARTICLE_CACHE_VERSION = 1;
+
+struct ParticleCacheHeader {
+	char magic[4];          // "FSPC"
+	uint32_t version;
+	uint32_t particleCount;
+	uint32_t attributes;    // flags every frame stores
+	float timeStep;         // seconds per simulation step
+	uint32_t frameCount;
+	uint64_t indexOffset;   // bytes from the start of the file
+};
+
+struct ParticleCacheFrameHeader {
+	uint32_t step;          // simulation steps taken when it was captured
+	uint32_t attributes;
+	uint64_t payloadSize;   // bytes of attribute data after this header
+};
+
+struct ParticleCacheIndexEntry {
+	uint64_t offset;        // of the frame header
+	uint32_t step;
+	uint32_t reserved;
+};
+
+// Appends frames to a cache file on a background thread. A few frames wait in
+// a queue, append blocks while it is full, so a slow disk slows the
+// simulation down instead of filling memory.
+class ParticleCacheWriter
+{
+public:
+		// attributes: ParticleCacheAttribute flags stored in every frame.
+		// timeStep: seconds per simulation step, for the readers' clocks
+		ParticleCacheWriter(const std::string& path, unsigned int particleCount, uint32_t attributes, float timeStep);
+		// Closes the cache
+		~ParticleCacheWriter();
+
+		ParticleCacheWriter(const ParticleCacheWriter&) = delete;
+		ParticleCacheWriter& operator=(const ParticleCacheWriter&) = delete;
+
+		// False when the file could not be created
+		bool isOpen() const { return _worker.joinable(); }
+		unsigned int particleCount() const { return _particleCount; }
+		uint32_t attributes() const { return _attributes; }
+
+		// Queues a frame, xyz of each vec4 is stored. Vectors of attributes the
+		// cache does not store may be empty.
+		void append(unsigned int step, std::vector<glm::vec4> positions, std::vector<glm::vec4> velocities);
+
+		// Writes the queued frames, the index and the final header. False when
+		// any write failed.
+		bool close();
+
+private:
+		struct Frame {
+			unsigned int step;
+			std::vector<glm::vec4> positions;
+			std::vector<glm::vec4> velocities;
+		};
+
+		std::ofstream _file;
+		unsigned int _particleCount;
+		uint32_t _attributes;
+		float _timeStep;
+		uint64_t _written; // bytes written so far, the offset of the next chunk
+		std::vector<ParticleCacheIndexEntry> _index;
+		bool _failed;
+
+		std::thread _worker;
+		std::mutex _mutex;
+		std::condition_variable _queued; // a frame was queued or the cache closes
+		std::condition_variable _freed;  // the worker took a frame
+		std::deque<Frame> _queue;
+		bool _closing;
+
+		void run();
+		void writeFrame(const Frame& frame, std::vector<float>& scratch);
+		void writeHeader(uint32_t frameCount, uint64_t indexOffset);
+};
+
+// Maps a cache file and finds any frame through the index without reading
+// the frames before it. The attribute arrays point into the mapping, pages
+// are read from disk only when touched.
+class ParticleCacheReader
+{
+public:
+		explicit ParticleCacheReader(const std::string& path);
+
+		// False when the file is missing or not a cache of this version
+		bool isOpen() const { return _valid; }
+		unsigned int particleCount() const { return _header.particleCount; }
+		uint32_t attributes() const { return _header.attributes; }
+		float timeStep() const { return _header.timeStep; }
+		// 0 when the file is not open
+		unsigned int frameCount() const;
+
+		// Simulation steps taken when the frame was captured
+		unsigned int step(unsigned int frame) const;
+
+		// particleCount() x, y, z floats, null when the frame lacks them or
+		// frame is out of range
+		const float* positions(unsigned int frame) const;
+		const float* velocities(unsigned int frame) const;
+
+private:
+		MappedFile _file;
+		bool _valid;
+		ParticleCacheHeader _header;
+		const unsigned char* _index; // the file's index or _scannedIndex
+		std::vector<ParticleCacheIndexEntry> _scannedIndex; // rebuilt for a cache that was never closed
+
+		const float* attribute(unsigned int frame, uint32_t attribute) const;
+		void scanFrames();
+};
+
+#endif
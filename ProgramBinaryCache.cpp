@@ -0,0 +1,103 @@
+#include "ProgramBinaryCache.h"
+#include<glad/glad.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+
+namespace {
+	// Header of a cached program binary, followed by 'length' bytes
+	struct ProgramBinaryHeader {
+		char magic[4];      // "FSPB"
+		uint32_t version;
+		uint32_t format;    // binary format reported by the driver
+		uint32_t length;
+	};
+
+	const uint32_t PROGRAM_BINARY_VERSION = 1;
+
+	std::string s_directory;
+
+	uint64_t HashString(const std::string& text, uint64_t hash = 14695981039346656037ull)
+	{
+		for (unsigned char c : text) {
+			hash ^= c;
+			hash *= 1099511628211ull;
+		}
+		return hash;
+	}
+
+	std::string GLString(GLenum name)
+	{
+		const GLubyte* text = glGetString(name);
+		return text ? reinterpret_cast<const char*>(text) : "";
+	}
+}
+
+void SetProgramBinaryCacheDirectory(const std::string& directory)
+{
+	s_directory = directory;
+}
+
+// The key covers the expanded source with its defines and the driver that
+// produced the binary, any change there lands in a different file
+std::string ProgramBinaryCachePath(const std::string& code)
+{
+	if (s_directory.empty()) return "";
+
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	if (formats == 0) return "";
+
+	uint64_t key = HashString(GLString(GL_VENDOR) + "\n" + GLString(GL_RENDERER) + "\n" + GLString(GL_VERSION) + "\n");
+	key = HashString(code, key);
+
+	char name[32];
+	std::snprintf(name, sizeof(name), "%016llx.bin", static_cast<unsigned long long>(key));
+	return (std::filesystem::path(s_directory) / name).string();
+}
+
+bool LoadProgramBinary(const std::string& path, unsigned int program)
+{
+	std::ifstream in(path, std::ios::binary);
+	if (!in.is_open()) return false;
+
+	ProgramBinaryHeader header;
+	if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) return false;
+	if (std::memcmp(header.magic, "FSPB", 4) != 0 || header.version != PROGRAM_BINARY_VERSION) return false;
+
+	std::vector<char> binary(header.length);
+	if (!in.read(binary.data(), binary.size())) return false;
+
+	glProgramBinary(program, header.format, binary.data(), GLsizei(binary.size()));
+
+	// Drivers reject binaries from other versions or hardware, the program
+	// is then linked from source
+	GLint success = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &success);
+	return success != 0;
+}
+
+void SaveProgramBinary(const std::string& path, unsigned int program)
+{
+	GLint success = 0, length = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &success);
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (!success || length <= 0) return;
+
+	ProgramBinaryHeader header = { { 'F', 'S', 'P', 'B' }, PROGRAM_BINARY_VERSION, 0, 0 };
+	std::vector<char> binary(length);
+	GLenum format = 0;
+	glGetProgramBinary(program, length, nullptr, &format, binary.data());
+	header.format = format;
+	header.length = uint32_t(length);
+
+	std::error_code error;
+	std::filesystem::create_directories(s_directory, error);
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	if (!out.is_open()) return;
+	out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+	out.write(binary.data(), binary.size());
+}
@@ -0,0 +1,21 @@
+#ifndef PROGRAM_BINARY_CACHE_H
+#define PROGRAM_BINARY_CACHE_H
+
+#include<string>
+
+// Linked program binaries on disk, shared by the compute and render programs.
+// Files are keyed by the program's source and the driver, empty directory
+// disables the cache.
+void SetProgramBinaryCacheDirectory(const std::string& directory);
+
+// Path of the binary for this source, empty when the cache is off or the
+// driver has no binary formats
+std::string ProgramBinaryCachePath(const std::string& code);
+
+// False for a missing or rejected binary, the caller links from source
+bool LoadProgramBinary(const std::string& path, unsigned int program);
+
+// Stores a linked program, ignored when it failed to link
+void SaveProgramBinary(const std::string& path, unsigned int program);
+
+#endif
@@ -5,6 +5,7 @@
 #include <cstddef>
 #include <glad/glad.h>
 #include <cassert>
+#include "Trace.h"
 
 template<typename T>
 class SSBO {
@@ -31,6 +32,7 @@ public:
 
     // Upload a full vector of data to the GPU buffer
     void upload(const std::vector<T>& data) {
+        TRACE_ZONE("SSBO::upload");
         if (data.size() != _count) {
             _count = data.size();
             glBindBuffer(GL_SHADER_STORAGE_BUFFER, _id);
@@ -43,6 +45,21 @@ public:
         glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
     }
 
+    // Reallocate storage for 'count' elements, previous contents are lost
+    void resize(size_t count, GLenum usage = GL_DYNAMIC_DRAW) {
+        _count = count;
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _id);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, _count * sizeof(T), nullptr, usage);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+
+    // Zero the whole buffer on the GPU without a client-side copy
+    void clear() {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _id);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R8UI, GL_RED_INTEGER, GL_UNSIGNED_BYTE, nullptr);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+
     // Bind this SSBO to the given binding point in GLSL
     void bindTo(GLuint bindingIndex) const {
         glBindBufferBase(
@@ -71,6 +88,17 @@ public:
         glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
     }
 
+    // Read 'count' elements starting at 'first' back from the GPU buffer
+    // This waits for pending shader writes, so keep the ranges small
+    std::vector<T> download(size_t first, size_t count) const {
+        std::vector<T> data(count);
+        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _id);
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, first * sizeof(T), count * sizeof(T), data.data());
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        return data;
+    }
+
     // Get the number of elements
     size_t count() const {
         return _count;
@@ -0,0 +1,227 @@
+#ifndef SSBO_ARENA_CLASS_H
+#define SSBO_ARENA_CLASS_H
+
+#include <vector>
+#include <cstddef>
+#include <algorithm>
+#include <glad/glad.h>
+#include "Trace.h"
+
+// One GL buffer holding many SSBO arrays in aligned sub-ranges.
+// Adding or resizing a range only marks the arena dirty, the buffer is laid out
+// again on next use and the old contents of every range are copied over.
+class SSBOArena {
+public:
+    SSBOArena()
+        : _id(0), _capacity(0), _dirty(false)
+    {
+        GLint alignment = 0;
+        glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        _alignment = std::max<GLint>(alignment, 16);
+    }
+
+    SSBOArena(const SSBOArena&) = delete;
+    SSBOArena& operator=(const SSBOArena&) = delete;
+
+    // Destructor: deletes the GPU buffer
+    ~SSBOArena() {
+        if (_id) glDeleteBuffers(1, &_id);
+    }
+
+    // Reserve a range of 'bytes', returns its handle
+    size_t addRange(size_t bytes) {
+        _ranges.push_back(Range{ 0, 0, bytes });
+        _dirty = true;
+        return _ranges.size() - 1;
+    }
+
+    void resizeRange(size_t range, size_t bytes) {
+        if (_ranges[range].size == bytes) return;
+        _ranges[range].size = bytes;
+        _dirty = true;
+    }
+
+    GLintptr offset(size_t range) {
+        commit();
+        return _ranges[range].offset;
+    }
+
+    size_t size(size_t range) const {
+        return _ranges[range].size;
+    }
+
+    // Zero every range at once
+    void clear() {
+        commit();
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _id);
+        glClearBufferData(GL_SHADER_STORAGE_BUFFER, GL_R8UI, GL_RED_INTEGER, GL_UNSIGNED_BYTE, nullptr);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+
+    // Copy of the whole arena, waits for pending shader writes
+    std::vector<unsigned char> snapshot() {
+        commit();
+        std::vector<unsigned char> bytes(_capacity);
+        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _id);
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, _capacity, bytes.data());
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        return bytes;
+    }
+
+    // Restore a snapshot taken with the same layout
+    bool restore(const std::vector<unsigned char>& bytes) {
+        commit();
+        if (bytes.size() != _capacity) return false;
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _id);
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, _capacity, bytes.data());
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        return true;
+    }
+
+    size_t capacity() {
+        commit();
+        return _capacity;
+    }
+
+    GLuint getID() {
+        commit();
+        return _id;
+    }
+
+private:
+    struct Range {
+        GLintptr offset;      // offset in the current buffer
+        size_t committedSize; // bytes that hold valid data at that offset
+        size_t size;          // requested bytes
+    };
+
+    GLuint _id;                  // OpenGL buffer handle
+    size_t _capacity;            // Size of the buffer in bytes
+    GLint _alignment;            // GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT
+    bool _dirty;                 // Ranges changed since the last layout
+    std::vector<Range> _ranges;
+
+    size_t alignUp(size_t bytes) const {
+        return (bytes + _alignment - 1) / _alignment * _alignment;
+    }
+
+    // Lay the ranges out back to back and move the old contents over
+    void commit() {
+        if (!_dirty) return;
+
+        std::vector<GLintptr> offsets(_ranges.size());
+        size_t capacity = 0;
+        for (size_t i = 0; i < _ranges.size(); ++i) {
+            offsets[i] = static_cast<GLintptr>(capacity);
+            capacity += alignUp(std::max<size_t>(_ranges[i].size, 1)); // ranges bound to GLSL may not be empty
+        }
+
+        GLuint id;
+        glGenBuffers(1, &id);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, id);
+        glBufferData(GL_COPY_WRITE_BUFFER, capacity, nullptr, GL_DYNAMIC_DRAW);
+
+        if (_id) {
+            glBindBuffer(GL_COPY_READ_BUFFER, _id);
+            for (size_t i = 0; i < _ranges.size(); ++i) {
+                size_t bytes = std::min(_ranges[i].committedSize, _ranges[i].size);
+                if (bytes > 0) {
+                    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, _ranges[i].offset, offsets[i], bytes);
+                }
+            }
+            glBindBuffer(GL_COPY_READ_BUFFER, 0);
+            glDeleteBuffers(1, &_id);
+        }
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+        for (size_t i = 0; i < _ranges.size(); ++i) {
+            _ranges[i].offset = offsets[i];
+            _ranges[i].committedSize = _ranges[i].size;
+        }
+        _id = id;
+        _capacity = capacity;
+        _dirty = false;
+    }
+};
+
+// Typed view of one arena range, same interface as SSBO<T> but binds
+// with glBindBufferRange
+template<typename T>
+class ArenaBuffer {
+public:
+    // Reserve room for 'count' elements in the arena
+    ArenaBuffer(SSBOArena& arena, size_t count)
+        : _arena(arena), _range(arena.addRange(count * sizeof(T))), _count(count)
+    {
+    }
+
+    // Upload a full vector of data, resizing the range if needed
+    void upload(const std::vector<T>& data) {
+        TRACE_ZONE("ArenaBuffer::upload");
+        if (data.size() != _count) resize(data.size());
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _arena.getID());
+        glBufferSubData(GL_SHADER_STORAGE_BUFFER, _arena.offset(_range), _count * sizeof(T), data.data());
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+
+    // Change the number of elements, contents up to the smaller size are kept
+    void resize(size_t count) {
+        _count = count;
+        _arena.resizeRange(_range, _count * sizeof(T));
+    }
+
+    // Zero this range on the GPU
+    void clear() {
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _arena.getID());
+        glClearBufferSubData(GL_SHADER_STORAGE_BUFFER, GL_R8UI, _arena.offset(_range), _count * sizeof(T), GL_RED_INTEGER, GL_UNSIGNED_BYTE, nullptr);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    }
+
+    // Bind this range to the given binding point in GLSL
+    void bindTo(GLuint bindingIndex) const {
+        glBindBufferRange(
+            GL_SHADER_STORAGE_BUFFER,
+            bindingIndex,
+            _arena.getID(),
+            _arena.offset(_range),
+            std::max<size_t>(_count * sizeof(T), 1)
+        );
+    }
+
+    // Read 'count' elements starting at 'first' back from the GPU
+    // This waits for pending shader writes, so keep the ranges small
+    std::vector<T> download(size_t first, size_t count) const {
+        std::vector<T> data(count);
+        glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, _arena.getID());
+        glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, _arena.offset(_range) + first * sizeof(T), count * sizeof(T), data.data());
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        return data;
+    }
+
+    // Get the number of elements
+    size_t count() const {
+        return _count;
+    }
+
+    // Size of one element, for code that handles views of any type as bytes
+    static constexpr size_t elementSize() {
+        return sizeof(T);
+    }
+
+    GLuint getID() const {
+        return _arena.getID();
+    }
+
+    GLintptr getOffset() const {
+        return _arena.offset(_range);
+    }
+
+private:
+    SSBOArena& _arena;
+    size_t _range;    // Handle of the range in the arena
+    size_t _count;    // Number of T elements
+};
+
+#endif
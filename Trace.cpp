@@ -0,0 +1,103 @@
+#include "Trace.h"
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+namespace {
+	struct Event {
+		std::string name;
+		double begin; // microseconds since start()
+		double duration;
+		int thread;   // 0 is the GPU
+	};
+
+	std::atomic<bool> s_enabled(false);
+	std::mutex s_mutex;
+	std::vector<Event> s_events;
+	std::chrono::steady_clock::time_point s_origin = std::chrono::steady_clock::now();
+
+	std::atomic<int> s_nextThread(1);
+	int ThreadIndex()
+	{
+		thread_local int index = s_nextThread++;
+		return index;
+	}
+
+	void Record(const std::string& name, double begin, double end, int thread)
+	{
+		std::lock_guard<std::mutex> lock(s_mutex);
+		s_events.push_back(Event{ name, begin, end - begin, thread });
+	}
+
+	std::string Escape(const std::string& text)
+	{
+		std::string result;
+		for (char c : text) {
+			if (c == '"' || c == '\\') result += '\\';
+			result += c;
+		}
+		return result;
+	}
+}
+
+void Trace::start()
+{
+	std::lock_guard<std::mutex> lock(s_mutex);
+	s_events.clear();
+	s_origin = std::chrono::steady_clock::now();
+	s_enabled = true;
+}
+
+bool Trace::stop(const std::string& path)
+{
+	s_enabled = false;
+	std::lock_guard<std::mutex> lock(s_mutex);
+
+	std::ofstream out(path);
+	if (!out.is_open()) return false;
+
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+	out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"FluidSim\"}},\n";
+	out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"GPU\"}}";
+	out.precision(3);
+	out << std::fixed;
+	for (const Event& event : s_events) {
+		out << ",\n{\"name\":\"" << Escape(event.name) << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.thread
+			<< ",\"ts\":" << event.begin << ",\"dur\":" << event.duration << "}";
+	}
+	out << "\n]}\n";
+	s_events.clear();
+	return bool(out);
+}
+
+bool Trace::enabled()
+{
+	return s_enabled;
+}
+
+double Trace::now()
+{
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - s_origin).count();
+}
+
+void Trace::zone(const std::string& name, double begin, double end)
+{
+	if (s_enabled) Record(name, begin, end, ThreadIndex());
+}
+
+void Trace::gpuZone(const std::string& name, double begin, double end)
+{
+	if (s_enabled) Record(name, begin, end, 0);
+}
+
+TraceZone::TraceZone(const char* name)
+	: _name(name), _begin(Trace::enabled() ? Trace::now() : -1.0)
+{
+}
+
+TraceZone::~TraceZone()
+{
+	if (_begin >= 0.0) Trace::zone(_name, _begin, Trace::now());
+}
@@ -0,0 +1,47 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include<string>
+
+// Records CPU zones and GPU stage spans as Chrome trace events, viewable in
+// ui.perfetto.dev or chrome://tracing. Nothing is recorded until start(),
+// a zone then costs one check.
+class Trace
+{
+public:
+		static void start();
+
+		// Writes the events recorded since start() and stops, false when the
+		// file could not be written
+		static bool stop(const std::string& path);
+
+		static bool enabled();
+
+		// Microseconds on the trace clock
+		static double now();
+
+		// A span that ran on the CPU thread calling this
+		static void zone(const std::string& name, double begin, double end);
+
+		// A span that ran on the GPU, already converted to the trace clock
+		static void gpuZone(const std::string& name, double begin, double end);
+};
+
+// Records the enclosing scope as a zone of the calling thread
+class TraceZone
+{
+public:
+		TraceZone(const char* name);
+
+		~TraceZone();
+
+private:
+		const char* _name;
+		double _begin;
+};
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_ZONE(name) TraceZone TRACE_CONCAT(traceZone, __LINE__)(name)
+
+#endif
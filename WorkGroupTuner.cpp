@@ -0,0 +1,126 @@
+#include "WorkGroupTuner.h"
+#include "ComputeShader.h"
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+namespace {
+	std::string GLString(GLenum name)
+	{
+		const GLubyte* text = glGetString(name);
+		return text ? reinterpret_cast<const char*>(text) : "";
+	}
+}
+
+WorkGroupTuner::WorkGroupTuner(const std::string& cachePath, unsigned int repeats)
+	: _path(cachePath), _repeats(repeats ? repeats : 1), _dirty(false)
+{
+	// Driver updates can change which size wins, so the version is part of it
+	_device = GLString(GL_VENDOR) + " | " + GLString(GL_RENDERER) + " | " + GLString(GL_VERSION);
+	load();
+}
+
+unsigned int WorkGroupTuner::tune(const std::string& kernel, unsigned int particleCount, ComputeShader& shader, const std::function<bool()>& run)
+{
+	unsigned int size = cached(kernel, particleCount);
+	if (size) {
+		shader.setWorkGroupSize(size);
+		return shader.workGroupSize();
+	}
+
+	// Also the warmup of the current program
+	if (!run()) return shader.workGroupSize();
+
+	unsigned int best = 0;
+	double bestMs = 0.0;
+	for (unsigned int candidate : candidateSizes()) {
+		shader.setWorkGroupSize(candidate);
+		// Waits for the build, a size the program can't link with reports 1
+		if (shader.workGroupSize() != candidate) continue;
+		run();
+
+		double ms = time(run);
+		if (ms >= 0.0 && (best == 0 || ms < bestMs)) {
+			best = candidate;
+			bestMs = ms;
+		}
+	}
+
+	if (best == 0) {
+		shader.setWorkGroupSize(0);
+		return shader.workGroupSize();
+	}
+	shader.setWorkGroupSize(best);
+	_sizes[std::make_tuple(_device, kernel, particleCount)] = best;
+	_dirty = true;
+	return best;
+}
+
+unsigned int WorkGroupTuner::cached(const std::string& kernel, unsigned int particleCount) const
+{
+	auto found = _sizes.find(std::make_tuple(_device, kernel, particleCount));
+	return found != _sizes.end() ? found->second : 0;
+}
+
+// One entry per line: kernel, particle count, size and device separated by
+// tabs, the device last since it is free text
+bool WorkGroupTuner::save() const
+{
+	if (!_dirty || _path.empty()) return true;
+
+	std::ofstream out(_path, std::ios::trunc);
+	if (!out.is_open()) return false;
+	out << "# kernel\tparticles\tworkgroup size\tdevice\n";
+	for (const auto& entry : _sizes) {
+		out << std::get<1>(entry.first) << "\t" << std::get<2>(entry.first) << "\t" << entry.second << "\t" << std::get<0>(entry.first) << "\n";
+	}
+	return bool(out);
+}
+
+std::vector<unsigned int> WorkGroupTuner::candidateSizes()
+{
+	GLint maxSizeX = 0, maxInvocations = 0;
+	glGetIntegeri_v(GL_MAX_COMPUTE_WORK_GROUP_SIZE, 0, &maxSizeX);
+	glGetIntegerv(GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS, &maxInvocations);
+
+	std::vector<unsigned int> sizes;
+	for (unsigned int size = 32; size <= 1024; size <<= 1) {
+		if (GLint(size) <= maxSizeX && GLint(size) <= maxInvocations) sizes.push_back(size);
+	}
+	return sizes;
+}
+
+// Lines that do not parse are dropped, the next save rewrites the file
+void WorkGroupTuner::load()
+{
+	std::ifstream in(_path);
+	std::string line;
+	while (std::getline(in, line)) {
+		if (line.empty() || line[0] == '#') continue;
+
+		std::istringstream fields(line);
+		std::string kernel, count, size, device;
+		if (!std::getline(fields, kernel, '\t') || !std::getline(fields, count, '\t') ||
+			!std::getline(fields, size, '\t') || !std::getline(fields, device)) continue;
+
+		unsigned int particleCount = static_cast<unsigned int>(std::strtoul(count.c_str(), nullptr, 10));
+		unsigned int workGroupSize = static_cast<unsigned int>(std::strtoul(size.c_str(), nullptr, 10));
+		if (particleCount && workGroupSize) _sizes[std::make_tuple(device, kernel, particleCount)] = workGroupSize;
+	}
+}
+
+double WorkGroupTuner::time(const std::function<bool()>& run) const
+{
+	GLuint query = 0;
+	glGenQueries(1, &query);
+
+	bool ran = true;
+	glBeginQuery(GL_TIME_ELAPSED, query);
+	for (unsigned int i = 0; i < _repeats; ++i) ran = run() && ran;
+	glEndQuery(GL_TIME_ELAPSED);
+
+	GLuint64 elapsed = 0;
+	glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+	glDeleteQueries(1, &query);
+	return ran ? elapsed * 1e-6 / _repeats : -1.0;
+}
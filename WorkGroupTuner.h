@@ -0,0 +1,51 @@
+#ifndef WORK_GROUP_TUNER_H
+#define WORK_GROUP_TUNER_H
+
+#include<glad/glad.h>
+#include<functional>
+#include<map>
+#include<string>
+#include<tuple>
+#include<vector>
+
+class ComputeShader;
+
+// Picks the workgroup size of each kernel by building it at several sizes and
+// timing it on the current device with GL_TIME_ELAPSED queries. The winners
+// are kept per device, kernel and particle count in a text cache file, so only
+// the first run on a machine pays for the search.
+class WorkGroupTuner
+{
+public:
+		// repeats: runs timed per candidate size
+		WorkGroupTuner(const std::string& cachePath, unsigned int repeats = 10);
+
+		// Sets the shader to the cached size or the fastest candidate. run
+		// executes the kernel once and returns false when it did not run in
+		// the current configuration, the shader then keeps its size. Returns
+		// the size in use.
+		unsigned int tune(const std::string& kernel, unsigned int particleCount, ComputeShader& shader, const std::function<bool()>& run);
+
+		// Size cached for this kernel and count on the current device, 0 if none
+		unsigned int cached(const std::string& kernel, unsigned int particleCount) const;
+
+		// Writes the cache back when something was tuned, false on failure
+		bool save() const;
+
+		// Powers of two from 32 up to what the device allows in x
+		static std::vector<unsigned int> candidateSizes();
+
+private:
+		std::string _path;
+		std::string _device;
+		unsigned int _repeats;
+		bool _dirty;
+		std::map<std::tuple<std::string, std::string, unsigned int>, unsigned int> _sizes; // by device, kernel and particle count
+
+		void load();
+
+		// GPU milliseconds per run, negative when a run was skipped
+		double time(const std::function<bool()>& run) const;
+};
+
+#endif
@@ -6,6 +6,9 @@ layout(std430, binding = 1) buffer Positions { vec4 positions[]; };
 
 layout(std430, binding = 3) buffer Velocities { vec4 velocities[]; };
 
+layout(std430, binding = 18) buffer HalfVelocities { uvec2 halfVelocities[]; }; // fp16 copy, see force_step.comp
+
+uniform bool useHalfVelocities;
 uniform float scale; // Added for future adaptive sampling implementation
 uniform mat4 view;
 uniform mat4 projection;
@@ -17,7 +20,14 @@ out vec3 velocity;
 void main()
 {
     vec3 instancePos = positions[gl_InstanceID].xyz;
-    vec3 instanceVel = velocities[gl_InstanceID].xyz;
+    vec3 instanceVel;
+    if (useHalfVelocities) {
+        uvec2 encoded = halfVelocities[gl_InstanceID];
+        instanceVel = vec3(unpackHalf2x16(encoded.x), unpackHalf2x16(encoded.y).x);
+    }
+    else {
+        instanceVel = velocities[gl_InstanceID].xyz;
+    }
     
     vec3 worldPos = instancePos + aPos * scale;
 
@@ -0,0 +1,215 @@
+// Shared by the simulation compute shaders through #include, see
+// ComputeShader::loadShaderSource. Must match SimulationParameters in Fluid.h.
+#ifndef FLUID_COMMON_GLSL
+#define FLUID_COMMON_GLSL
+
+struct Entry {
+    int index;
+    uint key;
+};
+
+layout(std430, binding = 8) buffer SimulationParameters {
+    float dt;
+    float gravityAcceleration;
+    float mass;
+    float collisionDamping;
+    float smoothingRadius;
+    float targetDensity;
+    float pressureMultiplier;
+    float viscosityStrength;
+    float nearDensityMultiplier;
+
+    uint isInteracting;
+    uint isPaused;
+    float inputPositionX;
+    float inputPositionY;
+    float inputPositionZ;
+    float interactionRadius;
+    float interactionStrength;
+
+    uint particleCount;
+    uint hashSize;
+    float spacing;
+    float particleRadius;
+    float boundaryX;
+    float boundaryY;
+    float boundaryZ;
+
+    uint gridMode;
+    uint blockTableSize;
+    uint blockCapacity;
+
+    float cellSize;
+    uint cellSizeFactor;
+    uint neighborOffsetCount;
+
+    uint packedDensities;
+    uint quantizePositions;
+    uint useHalfVelocities;
+
+    // Kernel normalization factors, derived from smoothingRadius on the CPU
+    float spikyPow2Scale;
+    float spikyPow3Scale;
+    float spikyPow2DerivativeScale;
+    float spikyPow3DerivativeScale;
+    float poly6Scale;
+
+    // Hashed grid cells are hashed with MixHash, see HashCell
+    uint hashMixing;
+};
+
+// Specialized builds inject these as literals so the neighbor loops fold
+// them, see Fluid::RefreshSpecialization. Generic builds read the block.
+#ifndef SPECIALIZED
+#define SMOOTHING_RADIUS smoothingRadius
+#define MASS mass
+#define HASH_SIZE hashSize
+#define CELL_SIZE cellSize
+#define SPIKY_POW2_SCALE spikyPow2Scale
+#define SPIKY_POW3_SCALE spikyPow3Scale
+#define SPIKY_POW2_DERIVATIVE_SCALE spikyPow2DerivativeScale
+#define SPIKY_POW3_DERIVATIVE_SCALE spikyPow3DerivativeScale
+#define POLY6_SCALE poly6Scale
+#define HASH_MIXING hashMixing
+#endif
+
+// Workgroup size of the kernels with one invocation per element, the
+// autotuner picks another through ComputeShader::setWorkGroupSize
+#ifndef LOCAL_SIZE
+#define LOCAL_SIZE 512
+#endif
+
+// Math constants
+const uint MAX_INT = 0xffffffffu;
+const float PI = 3.14159265359f;
+const float EPSILON = 1e-6f;
+
+// Smoothing kernels, all zero beyond the smoothing radius
+float SpikyPow2Kernel(float distance) {
+    if (distance > SMOOTHING_RADIUS) return 0.0f;
+
+    float v = SMOOTHING_RADIUS - distance;
+    return v * v * SPIKY_POW2_SCALE;
+}
+
+float SpikyPow3Kernel(float distance) {
+    if (distance > SMOOTHING_RADIUS) return 0.0f;
+
+    float v = SMOOTHING_RADIUS - distance;
+    return v * v * v * SPIKY_POW3_SCALE;
+}
+
+float SpikyPow2KernelDerivative(float distance) {
+    if (distance > SMOOTHING_RADIUS) return 0.0f;
+
+    float v = SMOOTHING_RADIUS - distance;
+    return -v * SPIKY_POW2_DERIVATIVE_SCALE;
+}
+
+float SpikyPow3KernelDerivative(float distance) {
+    if (distance > SMOOTHING_RADIUS) return 0.0f;
+
+    float v = SMOOTHING_RADIUS - distance;
+    return -v * v * SPIKY_POW3_DERIVATIVE_SCALE;
+}
+
+float Poly6Kernel(float distance) {
+    if (distance > SMOOTHING_RADIUS) return 0.0f;
+
+    float v = max(0.0f, SMOOTHING_RADIUS * SMOOTHING_RADIUS - distance * distance);
+    return v * v * v * POLY6_SCALE;
+}
+
+ivec3 PositionToCellCoord(vec3 point, float radius) {
+    return ivec3(
+        int(floor(point.x / radius)),
+        int(floor(point.y / radius)),
+        int(floor(point.z / radius))
+    );
+}
+
+// Murmur3 finalizer, every input bit reaches every output bit
+uint MixHash(uint h) {
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h;
+}
+
+// The XOR of prime multiples maps many nearby cells to the same hash, mixed
+// keys feed the coordinates through MixHash one after the other instead and
+// behave like random ones for any table size, see Fluid::TuneHashSize
+uint HashCell(ivec3 cell) {
+    if (HASH_MIXING != 0u) return MixHash(MixHash(MixHash(uint(cell.x)) ^ uint(cell.y)) ^ uint(cell.z));
+
+    const uint p1 = 73856093u;
+    const uint p2 = 19349663u;
+    const uint p3 = 83492791u;
+    return uint(cell.x) * p1 ^ uint(cell.y) * p2 ^ uint(cell.z) * p3;
+}
+
+uint GetKeyFromHash(uint hash) {
+    return hash % HASH_SIZE;
+}
+
+// Sparse grid: blocks of 4x4x4 cells are allocated on demand in an open
+// addressing table keyed by the packed block coordinate, every cell of an
+// allocated block gets its own key so lookups are collision-free.
+// Block coordinates wrap outside of +-1024 x +-512 y +-512 z blocks.
+const uint GRID_HASHED = 0u;
+const uint GRID_SPARSE = 1u;
+const int GRID_BLOCK_SHIFT = 2;
+const int GRID_BLOCK_DIM = 1 << GRID_BLOCK_SHIFT;
+const uint GRID_BLOCK_CELLS = uint(GRID_BLOCK_DIM * GRID_BLOCK_DIM * GRID_BLOCK_DIM);
+
+uint PackBlockCoord(ivec3 block) {
+    return (uint(block.x + 1024) & 0x7FFu)
+         | ((uint(block.y + 512) & 0x3FFu) << 11)
+         | ((uint(block.z + 512) & 0x3FFu) << 21);
+}
+
+uint HashBlock(uint tag) {
+    return MixHash(tag);
+}
+
+uint SparseCellKey(ivec3 cell, uint slot) {
+    ivec3 local = cell & (GRID_BLOCK_DIM - 1);
+    return slot * GRID_BLOCK_CELLS + uint(local.x + GRID_BLOCK_DIM * (local.y + GRID_BLOCK_DIM * local.z));
+}
+
+// Quantized positions: 16-bit fixed point offsets inside the particle's cell plus
+// its cell index in the domain grid, the tag the offsets are decoded against.
+// The host only enables them while the domain has fewer than 65536 cells, see
+// QUANTIZED_MAX_DOMAIN_CELLS in Fluid.h, so every cell has its own tag. Cells
+// outside the domain all get OUTSIDE_CELL_TAG and cannot be decoded.
+const uint OUTSIDE_CELL_TAG = 0xFFFFu;
+
+void DomainGrid(out ivec3 gridMin, out ivec3 gridDim) {
+    vec3 bounds = vec3(boundaryX, boundaryY, boundaryZ);
+    gridMin = ivec3(floor(-bounds / CELL_SIZE));
+    gridDim = ivec3(floor(bounds / CELL_SIZE)) - gridMin + 1;
+}
+
+uint DomainCellTag(ivec3 cell) {
+    ivec3 gridMin, gridDim;
+    DomainGrid(gridMin, gridDim);
+    ivec3 c = cell - gridMin;
+    if (any(lessThan(c, ivec3(0))) || any(greaterThanEqual(c, gridDim))) return OUTSIDE_CELL_TAG;
+    return uint(c.x + gridDim.x * (c.y + gridDim.y * c.z));
+}
+
+ivec3 DomainCellFromTag(uint tag) {
+    ivec3 gridMin, gridDim;
+    DomainGrid(gridMin, gridDim);
+    int t = int(tag);
+    return gridMin + ivec3(t % gridDim.x, (t / gridDim.x) % gridDim.y, t / (gridDim.x * gridDim.y));
+}
+
+vec3 DecodePosition(uvec2 quantized, ivec3 cell) {
+    vec3 local = vec3(quantized.x & 0xFFFFu, quantized.x >> 16, quantized.y & 0xFFFFu) / 65535.0;
+    return (vec3(cell) + local) * CELL_SIZE;
+}
+
+#endif
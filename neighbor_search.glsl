@@ -0,0 +1,95 @@
+// Neighbor cell traversal shared by the density and force passes.
+#ifndef NEIGHBOR_SEARCH_GLSL
+#define NEIGHBOR_SEARCH_GLSL
+
+#include "fluid_common.glsl"
+#include "sparse_grid.glsl"
+
+layout(std430, binding = 2) buffer PredictedPositions { vec4 predictedPositions[]; };
+layout(std430, binding = 6) buffer SpatialLookup { Entry spatialLookup[]; };
+layout(std430, binding = 7) buffer CellRanges { uvec2 cellRanges[]; }; // [start, end) per key
+layout(std430, binding = 16) buffer NeighborOffsets { ivec4 neighborOffsets[]; };
+layout(std430, binding = 17) buffer QuantizedPositions { uvec2 quantizedPositions[]; };
+
+// Neighbor cells come from a precomputed offset list that only holds cells
+// whose closest point lies within the smoothing radius, so every particle
+// within the radius sits in one of them. Hashed keys of the cells are gathered
+// once per particle with the repeated ones dropped: a bucket shared by several
+// of the cells is scanned once, and each candidate within the radius is a
+// neighbor. Sparse keys are unique per cell and come straight from the block
+// slots, looked up once per particle, at most 3 blocks per axis.
+#ifndef MAX_NEIGHBOR_CELLS
+#define MAX_NEIGHBOR_CELLS 343u // 7^3, three cells per radius
+#endif
+
+ivec3 searchCell;
+ivec3 blockCacheMin;
+uint blockSlotCache[27];
+uint neighborKeys[MAX_NEIGHBOR_CELLS];
+uint neighborKeyCount;
+
+// Key of a neighboring cell, MAX_INT when it cannot hold any particle
+uint NeighborCellKey(ivec3 cell) {
+    if (gridMode == GRID_SPARSE) {
+        ivec3 d = (cell >> GRID_BLOCK_SHIFT) - blockCacheMin;
+        uint slot = blockSlotCache[d.x + 3 * d.y + 9 * d.z];
+        return (slot == MAX_INT) ? MAX_INT : SparseCellKey(cell, slot);
+    }
+    return GetKeyFromHash(HashCell(cell));
+}
+
+void BeginNeighborSearch(vec3 position) {
+    searchCell = PositionToCellCoord(position, CELL_SIZE);
+    uint cells = min(neighborOffsetCount, MAX_NEIGHBOR_CELLS);
+
+    if (gridMode == GRID_SPARSE) {
+        int reach = int(cellSizeFactor);
+        blockCacheMin = (searchCell - reach) >> GRID_BLOCK_SHIFT;
+        ivec3 blockSpan = ((searchCell + reach) >> GRID_BLOCK_SHIFT) - blockCacheMin;
+        for (int b = 0; b < 27; ++b) {
+            ivec3 d = ivec3(b % 3, (b / 3) % 3, b / 9);
+            bool touched = all(lessThanEqual(d, blockSpan));
+            blockSlotCache[b] = touched ? FindBlockSlot(blockCacheMin + d) : MAX_INT;
+        }
+        neighborKeyCount = cells;
+        return;
+    }
+
+    // Repeats are rare, a key is only compared against the list when its bit
+    // in seenBits was set by an earlier one
+    neighborKeyCount = 0u;
+    uint seenBits = 0u;
+    for (uint k = 0u; k < cells; ++k) {
+        uint key = NeighborCellKey(searchCell + neighborOffsets[k].xyz);
+        uint bit = 1u << ((key * 0x9E3779B1u) >> 27);
+        bool seen = false;
+        if ((seenBits & bit) != 0u) {
+            for (uint n = 0u; n < neighborKeyCount && !seen; ++n) seen = neighborKeys[n] == key;
+        }
+        seenBits |= bit;
+        if (!seen) neighborKeys[neighborKeyCount++] = key;
+    }
+}
+
+// k-th key to scan, below neighborKeyCount. MAX_INT for a sparse cell in an
+// unallocated block.
+uint NeighborKey(uint k) {
+    if (gridMode == GRID_SPARSE) return NeighborCellKey(searchCell + neighborOffsets[k].xyz);
+    return neighborKeys[k];
+}
+
+// Position of a candidate, quantized ones are decoded in the cell their tag
+// names. False for quantized particles outside the domain, their cells share
+// one tag and they are never found.
+bool LoadCandidatePosition(uint particleIndex, out vec3 position) {
+    if (quantizePositions != 0u) {
+        uvec2 quantized = quantizedPositions[particleIndex];
+        uint cellTag = quantized.y >> 16;
+        position = DecodePosition(quantized, DomainCellFromTag(cellTag));
+        return cellTag != OUTSIDE_CELL_TAG;
+    }
+    position = predictedPositions[particleIndex].xyz;
+    return true;
+}
+
+#endif
@@ -1,4 +1,5 @@
 #include"shaderClass.h"
+#include"ProgramBinaryCache.h"
 
 // Reads a text file and outputs a string with everything in the text file
 std::string get_file_contents(const char* filename)
@@ -21,6 +22,13 @@ Shader::Shader(const char* vertexFile, const char* fragmentFile) {
 	std::string vertexCode = get_file_contents(vertexFile);
 	std::string fragmentCode = get_file_contents(fragmentFile);
 
+	ID = glCreateProgram();
+
+	// Linked programs share the compute programs' binary cache, keyed by both
+	// stages so an edit to either one links from source again
+	std::string cachePath = ProgramBinaryCachePath("#vertex\n" + vertexCode + "\n#fragment\n" + fragmentCode);
+	if (!cachePath.empty() && LoadProgramBinary(cachePath, ID)) return;
+
 	const char* vertexSource = vertexCode.c_str();
 	const char* fragmentSource = fragmentCode.c_str();
 
@@ -34,15 +42,16 @@ Shader::Shader(const char* vertexFile, const char* fragmentFile) {
 	glCompileShader(fragmentShader);
 	compileErrors(fragmentShader, "FRAGMENT");
 
-	ID = glCreateProgram();
-
 	glAttachShader(ID, vertexShader);
 	glAttachShader(ID, fragmentShader);
+	if (!cachePath.empty()) glProgramParameteri(ID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 	glLinkProgram(ID);
 	compileErrors(ID, "PROGRAM");
 
 	glDeleteShader(vertexShader);
 	glDeleteShader(fragmentShader);
+
+	if (!cachePath.empty()) SaveProgramBinary(cachePath, ID);
 }
 
 void Shader::setFloat(const std::string& name, float value) {
@@ -0,0 +1,35 @@
+// Block table lookups for shaders that turn positions into grid keys.
+// Needs fluid_common.glsl.
+#ifndef SPARSE_GRID_GLSL
+#define SPARSE_GRID_GLSL
+
+layout(std430, binding = 13) buffer BlockTable { uint blockTable[]; };
+layout(std430, binding = 14) buffer BlockSlots { uint blockSlots[]; };
+
+// Slot of an allocated block, MAX_INT when no particle lives in it
+uint FindBlockSlot(ivec3 block) {
+    uint tag = PackBlockCoord(block) + 1u; // 0 marks an empty table entry
+    uint mask = blockTableSize - 1u;
+    uint h = HashBlock(tag) & mask;
+
+    for (uint probe = 0u; probe < blockTableSize; ++probe) {
+        uint stored = blockTable[h];
+        if (stored == tag) return blockSlots[h];
+        if (stored == 0u) return MAX_INT;
+        h = (h + 1u) & mask;
+    }
+    return MAX_INT;
+}
+
+// Lookup key of the cell holding a position, MAX_INT for an unallocated block
+uint CellKey(vec3 position) {
+    ivec3 cell = PositionToCellCoord(position, CELL_SIZE);
+
+    if (gridMode == GRID_SPARSE) {
+        uint slot = FindBlockSlot(cell >> GRID_BLOCK_SHIFT);
+        return (slot == MAX_INT) ? MAX_INT : SparseCellKey(cell, slot);
+    }
+    return GetKeyFromHash(HashCell(cell));
+}
+
+#endif